@@ -0,0 +1,564 @@
+// Benchmark harness. Drives the engine in-process (no REPL, no pipes) and
+// reports throughput plus p50/p99/p999 latency per workload.
+//
+//   cc -O2 -o bench bench.c -lm -lpthread   (clang, see README.md)
+//   ./bench --workload all --ops 200000 --label $(git rev-parse --short HEAD) --output results.jsonl
+//
+// Every run appends one JSON line per workload to --output, so results from
+// different commits can be compared with bench_compare.rb.
+
+#define DB_NO_MAIN
+#include "db.c"
+
+#include <math.h>
+#include <time.h>
+
+
+
+
+/*
+  TYPE DEFINITIONS
+*/
+
+
+
+// HISTOGRAM
+
+
+// log-linear buckets: 2^HISTOGRAM_SUB_BITS linear steps per power of two,
+// which keeps every reported percentile within ~1.5% of the true value
+const uint32_t HISTOGRAM_SUB_BITS = 6;
+const uint32_t HISTOGRAM_NUM_BUCKETS = 64 * 64;
+
+struct Histogram_t {
+  uint64_t counts[HISTOGRAM_NUM_BUCKETS];
+  uint64_t total;
+  uint64_t max_ns;
+};
+typedef struct Histogram_t Histogram;
+
+
+
+// WORKLOAD
+
+
+enum Workload_t {
+  WORKLOAD_INSERT_SEQUENTIAL,
+  WORKLOAD_INSERT_RANDOM,
+  WORKLOAD_LOOKUP_ZIPF,
+  WORKLOAD_LOOKUP_MISS,
+  WORKLOAD_SCAN,
+  WORKLOAD_MIXED,
+  WORKLOAD_COUNT
+};
+typedef enum Workload_t Workload;
+
+const char* WORKLOAD_NAMES[] = {
+  "insert-seq",
+  "insert-rand",
+  "lookup-zipf",
+  "lookup-miss",
+  "scan",
+  "mixed"
+};
+
+struct BenchConfig_t {
+  uint64_t ops;
+  double zipf_theta;   // skew of point lookups. 0 = uniform
+  double read_ratio;   // share of reads in the mixed workload
+  uint32_t scan_length; // rows per range scan
+  uint64_t seed;
+  uint32_t page_size;   // for the fresh table of every round
+  bool hash_index;      // point lookups through the hash index
+  bool bloom;           // bloom filter in front of the tree
+  Engine engine;        // of the fresh table of every round
+  bool direct_io;       // O_DIRECT, past the os page cache
+  uint32_t num_shards;  // files the table is hash partitioned across
+  const char* label;
+  const char* output_path;
+  char db_path[64];
+};
+typedef struct BenchConfig_t BenchConfig;
+
+struct BenchResult_t {
+  uint64_t ops;
+  uint64_t rows; // rows touched, differs from ops for scans
+  double seconds; // time spent inside timed operations only
+  Histogram histogram;
+};
+typedef struct BenchResult_t BenchResult;
+
+
+
+
+/*
+  CLOCK + RANDOM
+*/
+
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+};
+
+
+
+uint64_t next_random(uint64_t* state) {
+  // xorshift64*
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 2685821657736338717ull;
+};
+
+
+
+double next_unit(uint64_t* state) {
+  return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+};
+
+
+
+// fisher-yates over keys 1..n
+void shuffle_keys(uint32_t* keys, uint32_t n, uint64_t* state) {
+  for (uint32_t i = 0; i < n; i++) {
+    keys[i] = i + 1;
+  }
+  for (uint32_t i = n - 1; i > 0; i--) {
+    uint32_t j = next_random(state) % (i + 1);
+    uint32_t tmp = keys[i];
+    keys[i] = keys[j];
+    keys[j] = tmp;
+  }
+};
+
+
+
+// cumulative distribution for zipf over ranks 1..n
+void build_zipf_cdf(double* cdf, uint32_t n, double theta) {
+  double sum = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    sum += 1.0 / pow(i + 1, theta);
+    cdf[i] = sum;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    cdf[i] /= sum;
+  }
+};
+
+
+
+uint32_t next_zipf_rank(double* cdf, uint32_t n, uint64_t* state) {
+  double u = next_unit(state);
+  uint32_t min = 0;
+  uint32_t max = n - 1;
+  while (min < max) {
+    uint32_t mid = (min + max) / 2;
+    if (cdf[mid] < u) {
+      min = mid + 1;
+    } else {
+      max = mid;
+    }
+  }
+  return min;
+};
+
+
+
+
+/*
+  HISTOGRAM
+*/
+
+
+uint32_t histogram_bucket(uint64_t value) {
+  if (value < (1u << HISTOGRAM_SUB_BITS)) {
+    return value;
+  }
+  uint32_t magnitude = 63 - __builtin_clzll(value); // >= SUB_BITS
+  uint32_t shift = magnitude - HISTOGRAM_SUB_BITS;
+  uint32_t bucket = ((shift + 1) << HISTOGRAM_SUB_BITS) + ((value >> shift) - (1u << HISTOGRAM_SUB_BITS));
+  return bucket < HISTOGRAM_NUM_BUCKETS ? bucket : HISTOGRAM_NUM_BUCKETS - 1;
+};
+
+
+
+// upper bound of the values in a bucket
+uint64_t histogram_bucket_value(uint32_t bucket) {
+  if (bucket < (1u << HISTOGRAM_SUB_BITS)) {
+    return bucket;
+  }
+  uint32_t shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+  uint64_t base = (1u << HISTOGRAM_SUB_BITS) + (bucket & ((1u << HISTOGRAM_SUB_BITS) - 1));
+  return ((base + 1) << shift) - 1;
+};
+
+
+
+void histogram_record(Histogram* histogram, uint64_t value_ns) {
+  histogram->counts[histogram_bucket(value_ns)] += 1;
+  histogram->total += 1;
+  if (value_ns > histogram->max_ns) {
+    histogram->max_ns = value_ns;
+  }
+};
+
+
+
+uint64_t histogram_percentile(Histogram* histogram, double percentile) {
+  if (histogram->total == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)ceil(histogram->total * percentile);
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen >= rank) {
+      uint64_t value = histogram_bucket_value(i);
+      return value < histogram->max_ns ? value : histogram->max_ns;
+    }
+  }
+  return histogram->max_ns;
+};
+
+
+
+
+/*
+  ENGINE ACCESS
+*/
+
+
+// rows a fresh table can always take. internal nodes do not split yet, so
+// tables stay tiny: workloads run in rounds, each on a new table. an lsm
+// table is only bound by the page limit, with room left for compactions.
+// shards split the rows unevenly, so only half of their combined room counts
+uint32_t round_capacity(BenchConfig* config) {
+  const NodeLayout* layout = node_layout_for(config->page_size);
+  uint32_t capacity = INTERNAL_NODE_MAX_CELLS * layout->leaf_node_right_split_count;
+  if (config->engine == ENGINE_LSM) {
+    capacity = layout->leaf_node_max_cells * (TABLE_MAX_PAGES / 4);
+  }
+  if (config->num_shards > 1) {
+    capacity = capacity * config->num_shards / 2;
+  }
+  return capacity;
+};
+
+
+
+void remove_db_files(BenchConfig* config) {
+  unlink(config->db_path);
+  for (uint32_t s = 1; s < config->num_shards; s++) {
+    char path[96];
+    snprintf(path, sizeof(path), "%s-shard%d", config->db_path, s);
+    unlink(path);
+  }
+};
+
+
+
+Table* open_fresh_table(BenchConfig* config) {
+  remove_db_files(config);
+  Table* table = db_open(config->db_path, config->page_size, config->engine, config->num_shards, config->direct_io);
+  if (config->hash_index) {
+    table_build_hash_index(table);
+  }
+  if (config->bloom) {
+    table_build_bloom(table);
+  }
+  return table;
+};
+
+
+
+void close_table(Table* table) {
+  db_close(table);
+  free(table);
+};
+
+
+
+// single-row insert through the regular executor
+void insert_key(Table* table, Statement* statement, uint32_t key) {
+  reset_statement(statement);
+  statement->type = STATEMENT_INSERT;
+  Row* row = statement_push_row(statement);
+  memset(row, 0, sizeof(Row));
+  row->id = key;
+  snprintf(row->username, sizeof(row->username), "user%u", key);
+  snprintf(row->email, sizeof(row->email), "person%u@example.com", key);
+
+  if (execute_insert(statement, table) != EXECUTE_SUCCESS) {
+    printf("Unexpected insert failure for key %u\n", key);
+    exit(EXIT_FAILURE);
+  }
+};
+
+
+
+bool lookup_key(Table* table, uint32_t key) {
+  return table_lookup(table, key) != NULL;
+};
+
+
+
+// read up to `length` rows starting at `key`. returns rows read
+uint32_t scan_from(Table* table, uint32_t key, uint32_t length) {
+  Cursor cursor = table_seek(table, key);
+
+  uint32_t rows = 0;
+  volatile uint32_t checksum = 0;
+  while (!cursor.end_of_table && rows < length) {
+    uint32_t id;
+    memcpy(&id, cursor_value(&cursor) + ID_OFFSET, ID_SIZE);
+    checksum += id;
+    rows++;
+    cursor_advance(&cursor);
+  }
+  return rows;
+};
+
+
+
+
+/*
+  WORKLOADS
+*/
+
+
+void run_workload(Workload workload, BenchConfig* config, BenchResult* result) {
+  uint32_t capacity = round_capacity(config);
+  uint32_t* keys = malloc(capacity * sizeof(uint32_t));
+  double* zipf_cdf = malloc(capacity * sizeof(double));
+  build_zipf_cdf(zipf_cdf, capacity, config->zipf_theta);
+  uint64_t random_state = config->seed;
+
+  Statement statement;
+  init_statement(&statement);
+  memset(result, 0, sizeof(BenchResult));
+
+  while (result->ops < config->ops) {
+    Table* table = open_fresh_table(config);
+    shuffle_keys(keys, capacity, &random_state);
+
+    // preload (untimed) for read workloads. mixed starts half full
+    uint32_t loaded = 0;
+    if (workload == WORKLOAD_LOOKUP_ZIPF || workload == WORKLOAD_LOOKUP_MISS || workload == WORKLOAD_SCAN) {
+      loaded = capacity;
+    } else if (workload == WORKLOAD_MIXED) {
+      loaded = capacity / 2;
+    }
+    // lookup-miss loads even ids and probes odd ones, so misses land
+    // inside the key range
+    for (uint32_t i = 0; i < loaded; i++) {
+      insert_key(table, &statement, workload == WORKLOAD_LOOKUP_MISS ? keys[i] * 2 : keys[i]);
+    }
+
+    // timed operations for this round
+    uint32_t next_insert = loaded;
+    uint32_t round_ops = (workload == WORKLOAD_INSERT_SEQUENTIAL || workload == WORKLOAD_INSERT_RANDOM)
+      ? capacity
+      : capacity * 4;
+    for (uint32_t op = 0; op < round_ops && result->ops < config->ops; op++) {
+      uint64_t start = now_ns();
+      uint32_t rows = 1;
+
+      switch (workload) {
+        case (WORKLOAD_INSERT_SEQUENTIAL):
+          insert_key(table, &statement, op + 1);
+          break;
+        case (WORKLOAD_INSERT_RANDOM):
+          insert_key(table, &statement, keys[op]);
+          break;
+        case (WORKLOAD_LOOKUP_ZIPF):
+          lookup_key(table, keys[next_zipf_rank(zipf_cdf, loaded, &random_state)]);
+          break;
+        case (WORKLOAD_LOOKUP_MISS):
+          lookup_key(table, 2 * (next_random(&random_state) % capacity) + 1);
+          break;
+        case (WORKLOAD_SCAN):
+          rows = scan_from(table, 1 + next_random(&random_state) % capacity, config->scan_length);
+          break;
+        case (WORKLOAD_MIXED):
+          if (next_insert < capacity && next_unit(&random_state) >= config->read_ratio) {
+            insert_key(table, &statement, keys[next_insert++]);
+          } else {
+            lookup_key(table, keys[next_zipf_rank(zipf_cdf, next_insert, &random_state)]);
+          }
+          break;
+        case (WORKLOAD_COUNT):
+          break;
+      }
+
+      uint64_t elapsed = now_ns() - start;
+      histogram_record(&(result->histogram), elapsed);
+      result->seconds += elapsed / 1e9;
+      result->rows += rows;
+      result->ops += 1;
+    }
+
+    close_table(table);
+  }
+
+  remove_db_files(config);
+  free(statement.arena.base);
+  free(zipf_cdf);
+  free(keys);
+};
+
+
+
+
+/*
+  REPORTING
+*/
+
+
+void report(Workload workload, BenchConfig* config, BenchResult* result) {
+  double ops_per_sec = result->seconds > 0 ? result->ops / result->seconds : 0;
+  double rows_per_sec = result->seconds > 0 ? result->rows / result->seconds : 0;
+  uint64_t p50 = histogram_percentile(&(result->histogram), 0.50);
+  uint64_t p99 = histogram_percentile(&(result->histogram), 0.99);
+  uint64_t p999 = histogram_percentile(&(result->histogram), 0.999);
+
+  printf(
+    "%-12s %10llu ops %12.0f ops/s %12.0f rows/s   p50 %6llu ns   p99 %6llu ns   p999 %6llu ns   max %8llu ns\n",
+    WORKLOAD_NAMES[workload], (unsigned long long)result->ops, ops_per_sec, rows_per_sec,
+    (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999,
+    (unsigned long long)result->histogram.max_ns
+  );
+
+  if (config->output_path == NULL) {
+    return;
+  }
+
+  FILE* output = fopen(config->output_path, "a");
+  if (output == NULL) {
+    printf("Unable to open %s\n", config->output_path);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(
+    output,
+    "{\"label\":\"%s\",\"workload\":\"%s\",\"ops\":%llu,\"rows\":%llu,\"seconds\":%.6f,"
+    "\"ops_per_sec\":%.1f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}\n",
+    config->label, WORKLOAD_NAMES[workload], (unsigned long long)result->ops,
+    (unsigned long long)result->rows, result->seconds, ops_per_sec,
+    (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999,
+    (unsigned long long)result->histogram.max_ns
+  );
+  fclose(output);
+};
+
+
+
+
+/*
+  MAIN
+*/
+
+
+void print_usage() {
+  printf("Usage: bench [--workload all|insert-seq|insert-rand|lookup-zipf|lookup-miss|scan|mixed]\n");
+  printf("             [--ops N] [--zipf THETA] [--read-ratio R] [--scan-length N]\n");
+  printf("             [--seed N] [--page-size N] [--hash-index on|off] [--bloom on|off]\n");
+  printf("             [--engine btree|lsm] [--direct-io on|off] [--shards N] [--label NAME]\n");
+  printf("             [--output FILE]\n");
+};
+
+
+
+int main(int argc, char* argv[]) {
+  BenchConfig config;
+  config.ops = 100000;
+  config.zipf_theta = 0.99;
+  config.read_ratio = 0.9;
+  config.scan_length = 10;
+  config.seed = 42;
+  config.page_size = DEFAULT_PAGE_SIZE;
+  config.hash_index = false;
+  config.bloom = false;
+  config.engine = ENGINE_BTREE;
+  config.direct_io = false;
+  config.num_shards = 1;
+  config.label = "unlabeled";
+  config.output_path = NULL;
+  snprintf(config.db_path, sizeof(config.db_path), "/tmp/db_bench_%d.db", getpid());
+
+  const char* workload_name = "all";
+
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) {
+      print_usage();
+      exit(EXIT_FAILURE);
+    }
+    const char* flag = argv[i];
+    const char* value = argv[++i];
+
+    if (strcmp(flag, "--workload") == 0) {
+      workload_name = value;
+    } else if (strcmp(flag, "--ops") == 0) {
+      config.ops = strtoull(value, NULL, 10);
+    } else if (strcmp(flag, "--zipf") == 0) {
+      config.zipf_theta = atof(value);
+    } else if (strcmp(flag, "--read-ratio") == 0) {
+      config.read_ratio = atof(value);
+    } else if (strcmp(flag, "--scan-length") == 0) {
+      config.scan_length = atoi(value);
+    } else if (strcmp(flag, "--seed") == 0) {
+      config.seed = strtoull(value, NULL, 10) | 1; // xorshift state must be non-zero
+    } else if (strcmp(flag, "--page-size") == 0) {
+      config.page_size = strtoul(value, NULL, 10);
+    } else if (strcmp(flag, "--hash-index") == 0) {
+      config.hash_index = (strcmp(value, "on") == 0);
+    } else if (strcmp(flag, "--bloom") == 0) {
+      config.bloom = (strcmp(value, "on") == 0);
+    } else if (strcmp(flag, "--engine") == 0) {
+      config.engine = strcmp(value, "lsm") == 0 ? ENGINE_LSM : ENGINE_BTREE;
+    } else if (strcmp(flag, "--direct-io") == 0) {
+      config.direct_io = (strcmp(value, "on") == 0);
+    } else if (strcmp(flag, "--shards") == 0) {
+      config.num_shards = strtoul(value, NULL, 10);
+    } else if (strcmp(flag, "--label") == 0) {
+      config.label = value;
+    } else if (strcmp(flag, "--output") == 0) {
+      config.output_path = value;
+    } else {
+      print_usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (node_layout_for(config.page_size) == NULL) {
+    printf("Unsupported page size %u\n", config.page_size);
+    exit(EXIT_FAILURE);
+  }
+  if (config.num_shards < 1 || config.num_shards > SHARDS_MAX) {
+    printf("Unsupported shard count %u\n", config.num_shards);
+    exit(EXIT_FAILURE);
+  }
+
+  bool ran = false;
+  for (uint32_t w = 0; w < WORKLOAD_COUNT; w++) {
+    if (strcmp(workload_name, "all") != 0 && strcmp(workload_name, WORKLOAD_NAMES[w]) != 0) {
+      continue;
+    }
+
+    BenchResult* result = malloc(sizeof(BenchResult));
+    run_workload(w, &config, result);
+    report(w, &config, result);
+    free(result);
+    ran = true;
+  }
+
+  if (!ran) {
+    printf("Unknown workload '%s'\n", workload_name);
+    print_usage();
+    exit(EXIT_FAILURE);
+  }
+
+  return 0;
+}
@@ -0,0 +1,41 @@
+# Compare two benchmark runs written by `bench --output`.
+#
+#   ruby bench_compare.rb baseline.jsonl candidate.jsonl
+#
+# A file may hold several runs; the last line per workload wins.
+require 'json'
+
+def load_results(path)
+  File.readlines(path).each_with_object({}) do |line, results|
+    next if line.strip.empty?
+    result = JSON.parse(line)
+    results[result['workload']] = result
+  end
+end
+
+if ARGV.length != 2
+  puts "Usage: ruby bench_compare.rb BASELINE CANDIDATE"
+  exit 1
+end
+
+baseline = load_results(ARGV[0])
+candidate = load_results(ARGV[1])
+
+def delta(before, after)
+  return '     n/a' if before.nil? || before.zero?
+  format('%+7.1f%%', (after - before) * 100.0 / before)
+end
+
+puts format('%-12s %14s %9s %9s %9s', 'workload', 'ops/s', 'ops/s', 'p99', 'p999')
+(baseline.keys & candidate.keys).each do |workload|
+  before = baseline[workload]
+  after = candidate[workload]
+  puts format(
+    '%-12s %14.0f %9s %9s %9s',
+    workload,
+    after['ops_per_sec'],
+    delta(before['ops_per_sec'], after['ops_per_sec']),
+    delta(before['p99_ns'], after['p99_ns']),
+    delta(before['p999_ns'], after['p999_ns'])
+  )
+end
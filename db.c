@@ -1,11 +1,38 @@
+#define _GNU_SOURCE // O_DIRECT
+
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// avx2 key search is picked at runtime
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define KEY_SEARCH_AVX2
+#endif
+
+// crc32c instructions: sse4.2 is picked at runtime, arm's at compile time
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_X86
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM
+#endif
+
 
 
 
@@ -40,17 +67,127 @@ typedef struct Row_t Row;
 
 
 
+// STATS
+
+
+// process-wide counters. plain increments, cheap enough to leave on
+struct Stats_t {
+  uint64_t statements;
+  uint64_t pages_read;
+  uint64_t pages_written;
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t node_splits;
+  uint64_t tree_descents;
+  uint64_t append_fast_paths; // descents skipped via the rightmost leaf
+  uint64_t swizzle_hits; // descent steps that followed a cached child frame
+  uint64_t hash_index_hits; // point lookups found in the hash index, without a descent
+  uint64_t rows_spilled; // rows an aggregate sent to disk for a later pass
+  uint64_t sort_runs; // sorted runs an order by wrote to disk
+  uint64_t memtable_flushes; // lsm memtables written out as level 0 runs
+  uint64_t compactions; // lsm runs merged into a deeper level
+  uint64_t bloom_skips; // searches (of a run or the tree) a bloom filter ruled out
+  uint64_t pages_warmed; // pages a warm-up loaded before anything asked for them
+  uint64_t bytes_serialized;
+  uint64_t syscalls;
+};
+typedef struct Stats_t Stats;
+
+Stats stats;
+
+// .timer and .statslog settings
+struct Instrumentation_t {
+  bool timer;
+  FILE* log;
+  uint64_t log_interval_ns;
+  uint64_t last_log_ns;
+};
+typedef struct Instrumentation_t Instrumentation;
+
+Instrumentation instrumentation;
+
+// wall + cpu clock readings around a statement
+struct StatementTimer_t {
+  uint64_t wall_ns;
+  uint64_t user_ns;
+  uint64_t system_ns;
+};
+typedef struct StatementTimer_t StatementTimer;
+
+
+
+// RESULT SINK
+
+
+const uint32_t SINK_BUFFER_SIZE = 1 << 16; // 64kb
+const uint32_t SINK_MAX_IOVECS = 64;
+
+enum OutputMode_t {
+  OUTPUT_TEXT,  // (id, username, email)
+  OUTPUT_CSV,   // id,username,email with a header line
+  OUTPUT_BINARY // per row: uint32 length, then the row as stored in the page.
+                // computed rows: per text field uint32 length + bytes, per number uint64
+};
+typedef enum OutputMode_t OutputMode;
+
+// one column of a computed row (e.g. an aggregate): text if `text` is set,
+// otherwise `number`
+struct SinkField_t {
+  const char* text;
+  uint32_t length;
+  uint64_t number;
+};
+typedef struct SinkField_t SinkField;
+
+// buffers result rows and writes them out in large writev calls. binary
+// rows are not copied at all: their iovecs point straight into the pages
+struct ResultSink_t {
+  int fd;
+  OutputMode mode;
+  char* buffer;
+  size_t used;
+  size_t pending_start; // buffer bytes from here on are not queued yet
+  struct iovec iov[SINK_MAX_IOVECS];
+  uint32_t iov_count;
+};
+typedef struct ResultSink_t ResultSink;
+
+
+
 // PAGER
 
 
-const uint32_t PAGE_SIZE = 4096; // 4kb
+// page size is chosen when a db file is created and kept in its header
+const uint32_t MIN_PAGE_SIZE = 4096;  // 4kb
+const uint32_t MAX_PAGE_SIZE = 65536; // 64kb
+const uint32_t DEFAULT_PAGE_SIZE = 4096;
 const uint32_t TABLE_MAX_PAGES = 100;
+const uint32_t BACKUP_CHUNK_PAGES = 64; // 256kb per backup read/write
+const uint32_t INTEGRITY_MAX_THREADS = 8;
+const uint32_t KEY_SEARCH_WINDOW = 32; // binary search narrows to this many keys, simd does the rest
+const uint32_t HOT_PAGES_MAX = 16; // most used pages the header keeps for the next warm-up
+const uint32_t WARM_UP_STEP_PAGES = 4; // pages a warm-up loads each time the repl waits for input
 
 struct Pager_t {
   int file_descriptor;
   uint32_t file_length;
   uint32_t num_pages;
+  uint32_t page_size;
+  bool direct_io; // O_DIRECT in effect: the frames are the only cache of the file
+  const struct NodeLayout_t* layout; // node capacities for page_size
+  void* frames; // slab of TABLE_MAX_PAGES page-aligned frames
+  uint32_t num_frames_used;
   void* pages[TABLE_MAX_PAGES];
+  void** swizzled; // per page: frame of each child of an internal node, NULL = not yet followed
+  uint32_t free_head; // first NODE_FREE page to reuse, 0 = none
+  uint64_t checkpoint_lsn; // checkpoints (full flushes) the file has seen
+  uint8_t changed[(TABLE_MAX_PAGES + 7) / 8]; // bitmap: pages written since the last backup
+  uint8_t dirty[(TABLE_MAX_PAGES + 7) / 8]; // bitmap: pages written since the last checkpoint
+  uint32_t uses[TABLE_MAX_PAGES]; // get_page calls per page this session, for the hot page list
+  uint32_t warm_up[TABLE_MAX_PAGES]; // pages queued to be loaded ahead of use
+  uint32_t warm_up_len;
+  uint32_t warm_up_next;
+  char backup_path[256]; // target of the last backup, "" if none yet
 };
 typedef struct Pager_t Pager;
 
@@ -69,9 +206,57 @@ const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
 const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
 const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 
+// HASH INDEX
+
+
+// optional key -> (page, cell) map in front of the tree. open addressing over
+// cache-line buckets: a probe reads one line and usually stops there. ids
+// start at 1, so key 0 marks an empty slot
+const uint32_t HASH_BUCKET_SLOTS = 8;
+const uint32_t HASH_CACHE_LINE = 64;
+const uint32_t HASH_INDEX_MAX_THREADS = 8; // for the rebuild at startup
+
+struct HashBucket_t {
+  uint32_t keys[HASH_BUCKET_SLOTS];
+  uint32_t locations[HASH_BUCKET_SLOTS]; // page num << 16 | cell num
+};
+typedef struct HashBucket_t HashBucket;
+
+struct HashIndex_t {
+  HashBucket* buckets; // cache-line aligned
+  uint32_t num_buckets; // power of two, sized for a full table at half load
+  uint32_t bucket_mask;
+  uint32_t shift; // 32 - log2(num_buckets)
+};
+typedef struct HashIndex_t HashIndex;
+
+// BLOOM FILTER
+
+
+// answers "definitely absent" or "maybe present" for a key. used per lsm
+// run, and optionally (--bloom) in front of a b-tree. never holds stale
+// keys: rows are not deleted
+const uint32_t BLOOM_BITS_PER_KEY = 10; // ~1% false positives
+const uint32_t BLOOM_HASHES = 7;
+
+struct BloomFilter_t {
+  uint64_t* bits;
+  uint32_t num_bits; // power of two
+};
+typedef struct BloomFilter_t BloomFilter;
+
 struct Table_t {
   Pager* pager;
   uint32_t root_page_num;
+  bool rightmost_leaf_cached; // cleared whenever a split reshapes the tree
+  uint32_t rightmost_leaf_page_num;
+  HashIndex* hash_index; // NULL unless enabled with --hash-index
+  BloomFilter* bloom; // NULL unless enabled with --bloom
+  struct Lsm_t* lsm; // NULL for a b-tree table
+  struct Table_t** shards; // set when this table only routes to one table per file
+  uint32_t num_shards; // of the sharded table this file belongs to (1 = not sharded)
+  uint32_t shard; // which of them this file is
+  struct ShardScan_t* shard_scan;
 };
 typedef struct Table_t Table;
 
@@ -92,6 +277,127 @@ typedef struct Cursor_t Cursor;
 
 
 
+// SHARDS
+
+
+const uint32_t SHARDS_MAX = 8;
+
+// a scan over every shard, merged in key order. as with an lsm scan the
+// position lives here and the sharded table's cursor only marks the end
+struct ShardScan_t {
+  Cursor cursors[SHARDS_MAX];
+  uint32_t current; // shard holding the next row
+};
+typedef struct ShardScan_t ShardScan;
+
+// pages a worker read into its shard's frames. stats are not thread safe,
+// so they are counted here and added up after the join
+struct ShardJob_t {
+  Pager* pager;
+  uint64_t pages_read;
+  uint64_t syscalls;
+};
+typedef struct ShardJob_t ShardJob;
+
+
+
+
+// ARENA
+
+
+const uint32_t STATEMENT_ARENA_SIZE = 1 << 20; // 1mb
+
+// bump allocator for per-statement scratch memory. reset after each statement
+struct Arena_t {
+  char* base;
+  size_t size;
+  size_t used;
+};
+typedef struct Arena_t Arena;
+
+
+
+
+// LSM
+
+
+// a table created with --engine lsm never rewrites pages in place. inserts
+// go to a write-ahead log and an in-memory skiplist (the memtable), and a
+// full memtable is written out as a sorted run: a chain of ordinary leaf
+// pages. level 0 takes runs straight from the memtable, so they may overlap.
+// every deeper level is one run, merged down once it outgrows its budget
+enum Engine_t {
+  ENGINE_BTREE,
+  ENGINE_LSM
+};
+typedef enum Engine_t Engine;
+
+const uint32_t LSM_MAX_HEIGHT = 12; // skiplist levels
+const uint32_t LSM_MEMTABLE_PAGES = 4; // flush once the memtable would fill this many leaves
+const uint32_t LSM_L0_MAX_RUNS = 4; // one more and level 0 merges into level 1
+const uint32_t LSM_MAX_LEVELS = 4;
+const uint32_t LSM_LEVEL_RATIO = 4; // level n holds up to LSM_LEVEL_RATIO^n memtables worth of pages
+const uint32_t LSM_MAX_RUNS = LSM_L0_MAX_RUNS + LSM_MAX_LEVELS;
+const uint32_t LSM_WAL_BUFFER_SIZE = 1 << 16; // 64kb
+const uint32_t LSM_WAL_RECORD_SIZE = sizeof(uint32_t) + ROW_SIZE + sizeof(uint32_t); // key, row, crc32c of both
+
+struct SkipNode_t {
+  uint32_t key;
+  uint8_t row[ROW_SIZE]; // serialized, as in a leaf
+  struct SkipNode_t* next[]; // one per level the node is on
+};
+typedef struct SkipNode_t SkipNode;
+
+struct Memtable_t {
+  Arena arena; // every node, dropped at once when the memtable is flushed
+  SkipNode* head;
+  uint32_t height;
+  uint32_t num_rows;
+  uint32_t max_rows;
+  uint64_t random_state;
+};
+typedef struct Memtable_t Memtable;
+
+// an immutable sorted run. only level, first page and page count are kept
+// in the file header: the rest is rebuilt from the leaf chain at open
+struct Run_t {
+  uint32_t level;
+  uint32_t num_pages;
+  uint32_t num_rows;
+  uint32_t min_key;
+  uint32_t max_key;
+  uint32_t* pages; // leaf chain in key order
+  uint32_t* fence_keys; // first key of each page
+  BloomFilter bloom;
+};
+typedef struct Run_t Run;
+
+// where a scan stands in every run and in the memtable. the current row is
+// the smallest key among them
+struct LsmScan_t {
+  SkipNode* node; // next memtable row, NULL when done
+  uint32_t page_index[LSM_MAX_RUNS]; // run's num_pages when done
+  uint32_t cell_num[LSM_MAX_RUNS];
+  uint32_t source; // run the current row comes from, LSM_MAX_RUNS for the memtable
+  void* row;
+};
+typedef struct LsmScan_t LsmScan;
+
+struct Lsm_t {
+  Memtable memtable;
+  Run runs[LSM_MAX_RUNS]; // level 0 newest first, then one run per deeper level
+  uint32_t num_runs;
+  int wal_fd;
+  char wal_path[256];
+  char* wal_buffer; // records not written to the log yet
+  size_t wal_used;
+  LsmScan scan; // statements never hold two scans open at once
+};
+typedef struct Lsm_t Lsm;
+
+
+
+
 // BTREE NODE
 
 
@@ -102,7 +408,9 @@ const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
 const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
 const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
 const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
-const uint8_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+const uint32_t NODE_CHECKSUM_SIZE = sizeof(uint32_t); // crc32c of the page, this field taken as absent
+const uint32_t NODE_CHECKSUM_OFFSET = PARENT_POINTER_OFFSET + PARENT_POINTER_SIZE;
+const uint8_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE + NODE_CHECKSUM_SIZE;
 
 // Internal Node Headers
 const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
@@ -111,11 +419,14 @@ const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET = INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
 const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE;
 
-// Internal Node Body
+// Internal Node Body: all keys, then all (left) children, so a search
+// only touches the key array
 const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
 const uint32_t INTERNAL_NODE_MAX_CELLS = 3; // hard coding this for now
+const uint32_t INTERNAL_NODE_KEYS_OFFSET = INTERNAL_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_CHILDREN_OFFSET = INTERNAL_NODE_KEYS_OFFSET + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_KEY_SIZE;
 
 // Leaf Node Headers
 const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
@@ -124,25 +435,116 @@ const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
 const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE;
 
-// Leaf Body
+// Leaf Body: all keys, then all values. the value array starts after room
+// for a full page of keys, so its offset depends on the page size
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
+const uint32_t LEAF_NODE_KEYS_OFFSET = LEAF_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE; // row to insert
-const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
 const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE; // each leaf node corresponds w/ a page size
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
 
-// Split constants
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2; // N original cells + one new one
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+// Append split: an insert past the end of the rightmost leaf keeps this
+// share of cells on the left (100 = leave the left leaf full, 90 = 90/10)
+const uint32_t LEAF_NODE_APPEND_SPLIT_PERCENT = 100;
+
+// Leaf capacity depends on the page size (each leaf node corresponds w/ a
+// page). NODE_LAYOUT works everything out for one size at compile time;
+// the pager picks the matching entry of NODE_LAYOUTS when it opens a file
+struct NodeLayout_t {
+  uint32_t page_size;
+  uint32_t leaf_node_space_for_cells;
+  uint32_t leaf_node_max_cells;
+  uint32_t leaf_node_values_offset;
+  uint32_t leaf_node_right_split_count; // N original cells + one new one
+  uint32_t leaf_node_left_split_count;
+  uint32_t leaf_node_append_left_split_count;
+  uint32_t leaf_node_merge_threshold; // .reorganize merges leaves below this
+};
+typedef struct NodeLayout_t NodeLayout;
+
+#define LEAF_NODE_MAX_CELLS_FOR(page_size) (((page_size) - LEAF_NODE_HEADER_SIZE) / LEAF_NODE_CELL_SIZE)
+#define LEAF_NODE_APPEND_LEFT_SPLIT_FOR(max_cells) \
+  ((max_cells) + 1) * LEAF_NODE_APPEND_SPLIT_PERCENT / 100 > (max_cells) \
+    ? (max_cells) \
+    : ((max_cells) + 1) * LEAF_NODE_APPEND_SPLIT_PERCENT / 100
+#define NODE_LAYOUT(page_size) { \
+  (page_size), \
+  (page_size) - LEAF_NODE_HEADER_SIZE, \
+  LEAF_NODE_MAX_CELLS_FOR(page_size), \
+  LEAF_NODE_KEYS_OFFSET + LEAF_NODE_MAX_CELLS_FOR(page_size) * LEAF_NODE_KEY_SIZE, \
+  (LEAF_NODE_MAX_CELLS_FOR(page_size) + 1) / 2, \
+  (LEAF_NODE_MAX_CELLS_FOR(page_size) + 1) - (LEAF_NODE_MAX_CELLS_FOR(page_size) + 1) / 2, \
+  LEAF_NODE_APPEND_LEFT_SPLIT_FOR(LEAF_NODE_MAX_CELLS_FOR(page_size)), \
+  LEAF_NODE_MAX_CELLS_FOR(page_size) / 2 \
+}
+
+// every supported page size, smallest first
+const NodeLayout NODE_LAYOUTS[] = {
+  NODE_LAYOUT(4096),
+  NODE_LAYOUT(8192),
+  NODE_LAYOUT(16384),
+  NODE_LAYOUT(32768),
+  NODE_LAYOUT(65536)
+};
+const uint32_t NUM_NODE_LAYOUTS = sizeof(NODE_LAYOUTS) / sizeof(NodeLayout);
 
 enum NodeType_t {
   NODE_INTERNAL,
-  NODE_LEAF
+  NODE_LEAF,
+  NODE_FREE // released by a merge, waiting to be reused
 };
 typedef enum NodeType_t NodeType;
 
+// Free pages chain together through the word after the common header
+const uint32_t FREE_PAGE_NEXT_SIZE = sizeof(uint32_t);
+const uint32_t FREE_PAGE_NEXT_OFFSET = COMMON_NODE_HEADER_SIZE;
+
+
+
+
+// FILE HEADER
+
+
+// page 0 describes the file. its magic and version fill the bytes in front
+// of NODE_CHECKSUM_OFFSET, so every page keeps its checksum in one place
+const uint32_t HEADER_PAGE_NUM = 0;
+const uint32_t HEADER_MAGIC_SIZE = 4;
+const uint32_t HEADER_MAGIC_OFFSET = 0;
+const uint32_t HEADER_VERSION_SIZE = sizeof(uint16_t);
+const uint32_t HEADER_VERSION_OFFSET = HEADER_MAGIC_OFFSET + HEADER_MAGIC_SIZE;
+const uint32_t HEADER_PAGE_SIZE_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_PAGE_SIZE_OFFSET = NODE_CHECKSUM_OFFSET + NODE_CHECKSUM_SIZE;
+const uint32_t HEADER_ROOT_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_ROOT_PAGE_OFFSET = HEADER_PAGE_SIZE_OFFSET + HEADER_PAGE_SIZE_SIZE;
+const uint32_t HEADER_FREELIST_HEAD_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_FREELIST_HEAD_OFFSET = HEADER_ROOT_PAGE_OFFSET + HEADER_ROOT_PAGE_SIZE;
+const uint32_t HEADER_PAGE_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_PAGE_COUNT_OFFSET = HEADER_FREELIST_HEAD_OFFSET + HEADER_FREELIST_HEAD_SIZE;
+const uint32_t HEADER_CHECKPOINT_LSN_SIZE = sizeof(uint64_t);
+const uint32_t HEADER_CHECKPOINT_LSN_OFFSET = HEADER_PAGE_COUNT_OFFSET + HEADER_PAGE_COUNT_SIZE;
+const uint32_t HEADER_ENGINE_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_ENGINE_OFFSET = HEADER_CHECKPOINT_LSN_OFFSET + HEADER_CHECKPOINT_LSN_SIZE;
+const uint32_t HEADER_NUM_RUNS_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_NUM_RUNS_OFFSET = HEADER_ENGINE_OFFSET + HEADER_ENGINE_SIZE;
+const uint32_t HEADER_RUN_SIZE = 3 * sizeof(uint32_t); // level, first page, page count
+const uint32_t HEADER_RUNS_OFFSET = HEADER_NUM_RUNS_OFFSET + HEADER_NUM_RUNS_SIZE;
+const uint32_t HEADER_NUM_HOT_PAGES_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_NUM_HOT_PAGES_OFFSET = HEADER_RUNS_OFFSET + LSM_MAX_RUNS * HEADER_RUN_SIZE;
+const uint32_t HEADER_HOT_PAGES_OFFSET = HEADER_NUM_HOT_PAGES_OFFSET + HEADER_NUM_HOT_PAGES_SIZE;
+const uint32_t HEADER_NUM_SHARDS_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_NUM_SHARDS_OFFSET = HEADER_HOT_PAGES_OFFSET + HOT_PAGES_MAX * sizeof(uint32_t);
+const uint32_t HEADER_SHARD_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_SHARD_OFFSET = HEADER_NUM_SHARDS_OFFSET + HEADER_NUM_SHARDS_SIZE;
+const uint32_t HEADER_SIZE = HEADER_SHARD_OFFSET + HEADER_SHARD_SIZE;
+
+// 1: magic, version, page size. root at page 1, free pages found by scanning
+// 2: adds root page, freelist head, page count and checkpoint lsn
+// 3: nodes keep keys apart from values / children (were interleaved cells)
+// 4: adds the engine and, for lsm tables, the run directory
+// 5: adds the shard count and which shard the file is
+const char DB_MAGIC[] = "SQLC";
+const uint16_t DB_FORMAT_VERSION = 5;
+const uint32_t ROOT_PAGE_NUM = HEADER_PAGE_NUM + 1; // root of a new (or version 1) file
+
 
 
 
@@ -154,9 +556,50 @@ enum StatementType_t {
   STATEMENT_SELECT
 };
 typedef enum StatementType_t StatementType;
+
+// output columns of an aggregate select
+enum SelectColumn_t {
+  COLUMN_USERNAME,
+  COLUMN_EMAIL,
+  COLUMN_COUNT,
+  COLUMN_MIN_ID,
+  COLUMN_MAX_ID,
+  COLUMN_SUM_ID
+};
+typedef enum SelectColumn_t SelectColumn;
+
+const char* SELECT_COLUMN_NAMES[] = {
+  "username",
+  "email",
+  "count(*)",
+  "min(id)",
+  "max(id)",
+  "sum(id)"
+};
+const uint32_t NUM_SELECT_COLUMN_NAMES = sizeof(SELECT_COLUMN_NAMES) / sizeof(char*);
+const uint32_t SELECT_MAX_COLUMNS = 8;
+
+enum SortColumn_t {
+  SORT_NONE, // leaf order, i.e. by id
+  SORT_ID,
+  SORT_USERNAME,
+  SORT_EMAIL
+};
+typedef enum SortColumn_t SortColumn;
+
 struct Statement_t {
   StatementType type;
-  Row row_to_insert; // for inserts only
+  Row* rows; // for inserts only. contiguous, lives in arena
+  uint32_t num_rows;
+  uint32_t select_id; // select where id = N. 0 = every row
+  SelectColumn columns[SELECT_MAX_COLUMNS]; // aggregate selects only
+  uint32_t num_columns; // 0 = whole rows
+  bool grouped;
+  SelectColumn group_by; // COLUMN_USERNAME or COLUMN_EMAIL, if grouped
+  SortColumn order_by; // whole-row selects only
+  bool descending;
+  uint32_t limit; // UINT32_MAX = no limit
+  Arena arena;
 };
 typedef struct Statement_t Statement;
 
@@ -171,10 +614,19 @@ enum PrepareResult_t {
   PREPARE_NEGATIVE_ID,
   PREPARE_SYNTAX_ERROR,
   PREPARE_STRING_TOO_LONG,
+  PREPARE_TOO_MANY_ROWS,
+  PREPARE_NOT_GROUPED, // a text column that is not the group by column
   PREPARE_UNRECOGNIZED
 };
 typedef enum PrepareResult_t PrepareResult;
 
+// single pass cursor over the input line. end points at the null terminator
+struct Scanner_t {
+  const char* pos;
+  const char* end;
+};
+typedef struct Scanner_t Scanner;
+
 
 
 
@@ -188,6 +640,90 @@ enum ExecuteResult_t {
 };
 typedef enum ExecuteResult_t ExecuteResult;
 
+// sort handle for batched inserts, so rows themselves never move
+struct RowRef_t {
+  uint32_t key;
+  Row* row;
+};
+typedef struct RowRef_t RowRef;
+
+
+
+// AGGREGATE
+
+
+// hash aggregation keeps at most `aggregate_max_groups` groups in memory
+// (.agglimit). rows of any other group go to one of the spill partitions,
+// and each partition is aggregated the same way afterwards
+const uint32_t AGGREGATE_DEFAULT_MAX_GROUPS = 1 << 16;
+const uint32_t AGGREGATE_SPILL_PARTITIONS = 16; // 4 hash bits per level
+const uint32_t AGGREGATE_MAX_DEPTH = 4; // the last level ignores the limit
+
+uint32_t aggregate_max_groups = AGGREGATE_DEFAULT_MAX_GROUPS;
+
+// two groups per cache line. the key lives in the table's key buffer
+struct AggregateGroup_t {
+  uint32_t hash;
+  uint32_t key_offset;
+  uint32_t key_length;
+  uint32_t min_id;
+  uint32_t max_id;
+  uint32_t padding;
+  uint64_t count;
+  uint64_t sum_id;
+};
+typedef struct AggregateGroup_t AggregateGroup;
+
+struct AggregateTable_t {
+  uint32_t* slots; // open addressing: group index + 1, 0 = empty
+  uint32_t num_slots; // power of two, at least twice the groups
+  AggregateGroup* groups; // in order of first appearance
+  uint32_t num_groups;
+  uint32_t groups_capacity;
+  char* keys;
+  size_t keys_used;
+  size_t keys_capacity;
+  uint32_t depth; // 0 for the scan, +1 per spill pass
+  FILE* spills[AGGREGATE_SPILL_PARTITIONS]; // NULL until a row spills there
+};
+typedef struct AggregateTable_t AggregateTable;
+
+
+
+// SORT
+
+
+// order by holds up to `sort_memory` bytes worth of rows (.sortmem). a limit
+// that fits is served by a top-k heap; anything bigger is sorted in runs
+// that are written out and merged
+const uint32_t SORT_DEFAULT_MEMORY = 4 << 20; // 4mb
+
+uint32_t sort_memory = SORT_DEFAULT_MEMORY;
+
+// rows are compared by an 8 byte prefix of the sort column first, so most
+// comparisons never touch the row
+struct SortRef_t {
+  uint64_t prefix;
+  void* row;
+  uint32_t run; // merge only: the run the row came from
+};
+typedef struct SortRef_t SortRef;
+
+// qsort has no context argument, so the order of the running sort lives here
+struct SortOrder_t {
+  SortColumn column;
+  bool descending;
+};
+typedef struct SortOrder_t SortOrder;
+
+SortOrder sort_order;
+
+struct SortRun_t {
+  FILE* file;
+  uint8_t row[ROW_SIZE]; // current row, refilled as the merge advances
+};
+typedef struct SortRun_t SortRun;
+
 
 
 
@@ -243,28 +779,38 @@ void read_input(Buffer* buf) {
 
 
 /*
-  ROW
+  ARENA
 */
 
 
-void serialize_row(Row* src, void* dest) {
-  memcpy(dest + ID_OFFSET, &(src->id), ID_SIZE);
-  memcpy(dest + USERNAME_OFFSET, &(src->username), USERNAME_SIZE);
-  memcpy(dest + EMAIL_OFFSET, &(src->email), EMAIL_SIZE);
+void arena_init(Arena* arena, size_t size) {
+  arena->base = malloc(size);
+  if (arena->base == NULL) {
+    printf("Unable to allocate arena\n");
+    exit(EXIT_FAILURE);
+  }
+  arena->size = size;
+  arena->used = 0;
 };
 
 
 
-void deserialize_row(void* src, Row* dest) {
-  memcpy(&(dest->id), src + ID_OFFSET, ID_SIZE);
-  memcpy(&(dest->username), src + USERNAME_OFFSET, USERNAME_SIZE);
-  memcpy(&(dest->email), src + EMAIL_OFFSET, EMAIL_SIZE);
+void* arena_alloc(Arena* arena, size_t size) {
+  // keep every allocation 8-byte aligned
+  size_t aligned = (size + 7) & ~((size_t)7);
+  if (arena->used + aligned > arena->size) {
+    return NULL;
+  }
+
+  void* ptr = arena->base + arena->used;
+  arena->used += aligned;
+  return ptr;
 };
 
 
 
-void print_row(Row* row) {
-  printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+void arena_reset(Arena* arena) {
+  arena->used = 0;
 };
 
 
@@ -272,782 +818,4869 @@ void print_row(Row* row) {
 
 
 
-
-
 /*
-  PAGER
+  ROW
 */
 
 
+void serialize_row(Row* src, void* dest) {
+  stats.bytes_serialized += ROW_SIZE;
+  memcpy(dest + ID_OFFSET, &(src->id), ID_SIZE);
+  memcpy(dest + USERNAME_OFFSET, &(src->username), USERNAME_SIZE);
+  memcpy(dest + EMAIL_OFFSET, &(src->email), EMAIL_SIZE);
+};
 
-Pager* pager_open(const char* filename) {
-  int fd = open(
-    filename,
-    O_RDWR |  // Read/Write mode
-    O_CREAT,  // Create file if it does not exist
-    S_IWUSR | // User write permission
-    S_IRUSR   // User read permission
-  );
 
-  if (fd == -1) {
-    printf("Unable to open file\n");
-    exit(EXIT_FAILURE);
-  }
 
-  // seek til EOF
-  off_t file_length = lseek(fd, 0, SEEK_END);
+void deserialize_row(void* src, Row* dest) {
+  memcpy(&(dest->id), src + ID_OFFSET, ID_SIZE);
+  memcpy(&(dest->username), src + USERNAME_OFFSET, USERNAME_SIZE);
+  memcpy(&(dest->email), src + EMAIL_OFFSET, EMAIL_SIZE);
+};
 
-  Pager* pager = malloc(sizeof(Pager));
-  pager->file_descriptor = fd;
-  pager->file_length = file_length;
-  pager->num_pages = (file_length / PAGE_SIZE);
 
-  if (file_length % PAGE_SIZE != 0) {
-    printf("Db file is not a whole number of pages. Corrupt file\n");
-    exit(EXIT_FAILURE);
-  }
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    pager->pages[i] = NULL; // init to null
-  }
+/*
+  RESULT SINK
+*/
 
-  return pager;
+
+ResultSink* make_sink(int fd) {
+  ResultSink* sink = malloc(sizeof(ResultSink));
+  sink->fd = fd;
+  sink->mode = OUTPUT_TEXT;
+  sink->buffer = malloc(SINK_BUFFER_SIZE);
+  sink->used = 0;
+  sink->pending_start = 0;
+  sink->iov_count = 0;
+
+  return sink;
 };
 
 
 
-void* get_page(Pager* pager, uint32_t page_num) {
-  // case 1: out of bounds page
-  if (page_num > TABLE_MAX_PAGES) {
-    printf("Cannot fetch out of bounds page number. %d > %d\n", page_num, TABLE_MAX_PAGES);
-    exit(EXIT_FAILURE);
+// turn buffered bytes not yet covered by an iovec into one
+void sink_queue_buffered(ResultSink* sink) {
+  if (sink->used > sink->pending_start) {
+    sink->iov[sink->iov_count].iov_base = sink->buffer + sink->pending_start;
+    sink->iov[sink->iov_count].iov_len = sink->used - sink->pending_start;
+    sink->iov_count += 1;
+    sink->pending_start = sink->used;
   }
+};
 
-  // case 2: no page found aka cache miss
-  if (pager->pages[page_num] == NULL) {
-
-    // allocate memory for page
-    void* page = malloc(PAGE_SIZE);
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
 
-    // partial page
-    if (pager->file_length % PAGE_SIZE) {
-      num_pages += 1;
-    }
 
-    if (page_num <= num_pages) {
-      // set offset to base of page to retrieve
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+void sink_flush(ResultSink* sink) {
+  sink_queue_buffered(sink);
 
-      // [disk] read in the full page into "page"
-      ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-      if (bytes_read == -1) {
-        printf("Error reading file: %d\n", errno);
-        exit(EXIT_FAILURE);
+  struct iovec* iov = sink->iov;
+  uint32_t count = sink->iov_count;
+  while (count > 0) {
+    stats.syscalls += 1;
+    ssize_t bytes_written = writev(sink->fd, iov, count);
+    if (bytes_written == -1) {
+      if (errno == EINTR) {
+        continue;
       }
+      printf("Error writing results: %d\n", errno);
+      exit(EXIT_FAILURE);
     }
 
-    pager->pages[page_num] = page;
-
-    if (page_num >= pager->num_pages) {
-      pager->num_pages = page_num + 1;
+    // drop what made it out, resume mid-iovec on a short write
+    while (count > 0 && (size_t)bytes_written >= iov->iov_len) {
+      bytes_written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char*)iov->iov_base + bytes_written;
+      iov->iov_len -= bytes_written;
     }
   }
 
-  // return pointer to page
-  return pager->pages[page_num];
+  sink->used = 0;
+  sink->pending_start = 0;
+  sink->iov_count = 0;
 };
 
 
 
-void pager_flush(Pager* pager, uint32_t page_num) {
-  if (pager->pages[page_num] == NULL) {
-    printf("Tried to flush null page\n");
-    exit(EXIT_FAILURE);
+// room for `size` more bytes in the buffer (plus one spare iovec)
+char* sink_reserve(ResultSink* sink, size_t size) {
+  if (sink->used + size > SINK_BUFFER_SIZE || sink->iov_count + 2 > SINK_MAX_IOVECS) {
+    sink_flush(sink);
   }
+  return sink->buffer + sink->used;
+};
 
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-  if (offset == -1) {
-    printf("Error seeking: %d\n", errno);
-    exit(EXIT_FAILURE);
-  }
 
-  // PERSIST TO DISK!
-  ssize_t bytes_written = write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-  if (bytes_written == -1) {
-    printf("Error writing: %d\n", errno);
-    exit(EXIT_FAILURE);
+
+// queue bytes that stay valid until the next flush, without copying them
+void sink_reference(ResultSink* sink, const void* data, size_t size) {
+  if (sink->iov_count + 2 > SINK_MAX_IOVECS) {
+    sink_flush(sink);
   }
+  sink_queue_buffered(sink);
+  sink->iov[sink->iov_count].iov_base = (void*)data;
+  sink->iov[sink->iov_count].iov_len = size;
+  sink->iov_count += 1;
 };
 
 
-// for now, not recycling free pages. just go to end of db file.
-uint32_t get_unused_page_num(Pager* pager) {
-  return pager->num_pages;
+
+// append decimal digits of `value` at `dest`, returns bytes written
+size_t format_uint(char* dest, uint32_t value) {
+  char digits[10];
+  size_t length = 0;
+  do {
+    digits[length++] = '0' + (value % 10);
+    value /= 10;
+  } while (value > 0);
+
+  for (size_t i = 0; i < length; i++) {
+    dest[i] = digits[length - 1 - i];
+  }
+  return length;
 };
 
 
 
-/*
-  B-Tree
-*/
+// append a csv field, quoting it only if it needs to be
+size_t format_csv_field(char* dest, const char* field, size_t length) {
+  if (memchr(field, ',', length) == NULL && memchr(field, '"', length) == NULL) {
+    memcpy(dest, field, length);
+    return length;
+  }
 
+  size_t n = 0;
+  dest[n++] = '"';
+  for (size_t i = 0; i < length; i++) {
+    if (field[i] == '"') {
+      dest[n++] = '"';
+    }
+    dest[n++] = field[i];
+  }
+  dest[n++] = '"';
+  return n;
+};
 
-// node getters + setters (in-place)
 
 
+// start of a result set. anything printf'd so far (the prompt) must land
+// before our raw writes to the same fd. `header` is the csv header line
+void sink_begin_with_header(ResultSink* sink, const char* header) {
+  fflush(stdout);
 
-bool is_node_root(void* node) {
-  uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
-  return (bool)value;
+  if (sink->mode == OUTPUT_CSV) {
+    char* dest = sink_reserve(sink, strlen(header));
+    memcpy(dest, header, strlen(header));
+    sink->used += strlen(header);
+  }
 };
 
 
 
-void set_node_root(void* node, bool is_root) {
-  uint8_t value = is_root;
-  *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+void sink_begin(ResultSink* sink) {
+  sink_begin_with_header(sink, "id,username,email\n");
 };
 
 
 
-NodeType get_node_type(void* node) {
-  uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET)); // casting to uint8_t
-  return (NodeType)value;
+// emit one row straight from its serialized form in a page
+void sink_write_row(ResultSink* sink, void* row) {
+  uint32_t id;
+  memcpy(&id, row + ID_OFFSET, ID_SIZE);
+  const char* username = row + USERNAME_OFFSET;
+  const char* email = row + EMAIL_OFFSET;
+  size_t username_length = strnlen(username, COL_USERNAME_SIZE);
+  size_t email_length = strnlen(email, COL_EMAIL_SIZE);
+  char* dest;
+  size_t n = 0;
+
+  switch (sink->mode) {
+    case (OUTPUT_TEXT):
+      // "(" + 10 digits + ", " + ", " + ")\n"
+      dest = sink_reserve(sink, 17 + username_length + email_length);
+      dest[n++] = '(';
+      n += format_uint(dest + n, id);
+      dest[n++] = ',';
+      dest[n++] = ' ';
+      memcpy(dest + n, username, username_length);
+      n += username_length;
+      dest[n++] = ',';
+      dest[n++] = ' ';
+      memcpy(dest + n, email, email_length);
+      n += email_length;
+      dest[n++] = ')';
+      dest[n++] = '\n';
+      sink->used += n;
+      break;
+    case (OUTPUT_CSV):
+      // 10 digits + 2 commas + 4 quotes + "\n", every field char quoted
+      dest = sink_reserve(sink, 17 + 2 * (username_length + email_length));
+      n += format_uint(dest + n, id);
+      dest[n++] = ',';
+      n += format_csv_field(dest + n, username, username_length);
+      dest[n++] = ',';
+      n += format_csv_field(dest + n, email, email_length);
+      dest[n++] = '\n';
+      sink->used += n;
+      break;
+    case (OUTPUT_BINARY):
+      dest = sink_reserve(sink, sizeof(uint32_t));
+      uint32_t length = ROW_SIZE;
+      memcpy(dest, &length, sizeof(uint32_t));
+      sink->used += sizeof(uint32_t);
+      sink_reference(sink, row, ROW_SIZE);
+      break;
+  }
 };
 
 
 
-void set_node_type(void* node, NodeType type) {
-  uint8_t value = type;
-  *((uint8_t*)(node + NODE_TYPE_OFFSET)) = value; // casting to uint8_t
+// emit one computed row. same shape as stored rows in text and csv
+void sink_write_fields(ResultSink* sink, SinkField* fields, uint32_t num_fields) {
+  size_t size = 0;
+  for (uint32_t i = 0; i < num_fields; i++) {
+    size += fields[i].text != NULL ? sizeof(uint32_t) + 2 * fields[i].length + 2 : 20;
+  }
+  char* dest = sink_reserve(sink, size + 2 * num_fields + 8);
+  size_t n = 0;
+
+  switch (sink->mode) {
+    case (OUTPUT_TEXT):
+      dest[n++] = '(';
+      for (uint32_t i = 0; i < num_fields; i++) {
+        if (i > 0) {
+          dest[n++] = ',';
+          dest[n++] = ' ';
+        }
+        if (fields[i].text != NULL) {
+          memcpy(dest + n, fields[i].text, fields[i].length);
+          n += fields[i].length;
+        } else {
+          n += sprintf(dest + n, "%llu", (unsigned long long)fields[i].number);
+        }
+      }
+      dest[n++] = ')';
+      dest[n++] = '\n';
+      break;
+    case (OUTPUT_CSV):
+      for (uint32_t i = 0; i < num_fields; i++) {
+        if (i > 0) {
+          dest[n++] = ',';
+        }
+        if (fields[i].text != NULL) {
+          n += format_csv_field(dest + n, fields[i].text, fields[i].length);
+        } else {
+          n += sprintf(dest + n, "%llu", (unsigned long long)fields[i].number);
+        }
+      }
+      dest[n++] = '\n';
+      break;
+    case (OUTPUT_BINARY):
+      n = sizeof(uint32_t); // length goes in front once known
+      for (uint32_t i = 0; i < num_fields; i++) {
+        if (fields[i].text != NULL) {
+          memcpy(dest + n, &(fields[i].length), sizeof(uint32_t));
+          memcpy(dest + n + sizeof(uint32_t), fields[i].text, fields[i].length);
+          n += sizeof(uint32_t) + fields[i].length;
+        } else {
+          memcpy(dest + n, &(fields[i].number), sizeof(uint64_t));
+          n += sizeof(uint64_t);
+        }
+      }
+      uint32_t length = n - sizeof(uint32_t);
+      memcpy(dest, &length, sizeof(uint32_t));
+      break;
+  }
+  sink->used += n;
 };
 
 
-uint32_t* node_parent(void* node) {
-  return node + PARENT_POINTER_OFFSET;
+
+// like sink_write_row, for a row in a buffer that is about to be reused
+void sink_write_row_copy(ResultSink* sink, void* row) {
+  if (sink->mode != OUTPUT_BINARY) {
+    sink_write_row(sink, row);
+    return;
+  }
+  char* dest = sink_reserve(sink, sizeof(uint32_t) + ROW_SIZE);
+  uint32_t length = ROW_SIZE;
+  memcpy(dest, &length, sizeof(uint32_t));
+  memcpy(dest + sizeof(uint32_t), row, ROW_SIZE);
+  sink->used += sizeof(uint32_t) + ROW_SIZE;
 };
 
 
 
-uint32_t* internal_node_num_keys(void* node) {
-  return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+void sink_end(ResultSink* sink) {
+  sink_flush(sink);
 };
 
 
 
-uint32_t* internal_node_right_child(void* node) {
-  return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
-};
 
 
 
-uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
-  return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
-};
 
 
+/*
+  CHECKSUM
+*/
 
-uint32_t* internal_node_child(void* node, uint32_t child_num) {
-  uint32_t num_keys = *internal_node_num_keys(node);
-  if (child_num > num_keys) {
-    printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
-    exit(EXIT_FAILURE);
-  } else if (child_num == num_keys) { // one beyond
-    return internal_node_right_child(node);
-  } else { // left_child
-    return internal_node_cell(node, child_num);
-  }
-};
 
 
+// crc32c (castagnoli), reflected polynomial
+uint32_t crc32c_table[256];
 
-uint32_t* internal_node_key(void* node, uint32_t key_num) {
-  return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+void crc32c_init_table() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+    }
+    crc32c_table[i] = crc;
+  }
 };
 
 
 
-uint32_t* leaf_node_num_cells(void* node) {
-  return node + LEAF_NODE_NUM_CELLS_OFFSET;
+uint32_t crc32c_software(uint32_t crc, const uint8_t* data, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    crc = (crc >> 8) ^ crc32c_table[(crc ^ data[i]) & 0xFF];
+  }
+  return crc;
 };
 
 
 
-void* leaf_node_cell(void* node, uint32_t cell_num) {
-  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+#if defined(CRC32C_X86)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hardware(uint32_t crc, const uint8_t* data, size_t size) {
+  uint64_t crc64 = crc;
+  while (size >= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    size -= 8;
+  }
+  crc = (uint32_t)crc64;
+  while (size > 0) {
+    crc = _mm_crc32_u8(crc, *data);
+    data++;
+    size--;
+  }
+  return crc;
+};
+#elif defined(CRC32C_ARM)
+uint32_t crc32c_hardware(uint32_t crc, const uint8_t* data, size_t size) {
+  while (size >= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    crc = __crc32cd(crc, word);
+    data += 8;
+    size -= 8;
+  }
+  while (size > 0) {
+    crc = __crc32cb(crc, *data);
+    data++;
+    size--;
+  }
+  return crc;
 };
+#endif
 
 
 
-uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num);
+// picked on first use: the crc instruction if the cpu has one, else the table
+uint32_t (*crc32c_update)(uint32_t crc, const uint8_t* data, size_t size) = NULL;
+
+void crc32c_select() {
+  crc32c_init_table();
+  crc32c_update = crc32c_software;
+#if defined(CRC32C_X86)
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_update = crc32c_hardware;
+  }
+#elif defined(CRC32C_ARM)
+  crc32c_update = crc32c_hardware;
+#endif
 };
 
 
 
-void* leaf_node_value(void* node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+uint32_t* node_checksum(void* node) {
+  return node + NODE_CHECKSUM_OFFSET;
 };
 
 
-uint32_t* leaf_node_next_leaf(void* node) {
-  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
-};
-
 
+// crc32c over the whole page except the checksum field itself
+uint32_t page_checksum(void* page, uint32_t page_size) {
+  if (crc32c_update == NULL) {
+    crc32c_select();
+  }
 
-void initialize_leaf_node(void* node) {
-  set_node_type(node, NODE_LEAF);
-  set_node_root(node, false);     // not root
-  *leaf_node_num_cells(node) = 0; // no children
-  *leaf_node_next_leaf(node) = 0; // no sibling
+  uint32_t after = NODE_CHECKSUM_OFFSET + NODE_CHECKSUM_SIZE;
+  uint32_t crc = ~0u;
+  crc = crc32c_update(crc, page, NODE_CHECKSUM_OFFSET);
+  crc = crc32c_update(crc, (uint8_t*)page + after, page_size - after);
+  return ~crc;
 };
 
 
 
-void initialize_internal_node(void* node) {
-  set_node_type(node, NODE_INTERNAL);
-  set_node_root(node, false);
-  *internal_node_num_keys(node) = 0;
+void page_update_checksum(void* page, uint32_t page_size) {
+  *node_checksum(page) = page_checksum(page, page_size);
 };
 
 
 
-uint32_t get_node_max_key(void* node) {
-  switch(get_node_type(node)) {
-    case NODE_INTERNAL: // rightmost key
-      return *internal_node_key(node, *internal_node_num_keys(node) - 1);
-    case NODE_LEAF: // max index
-      return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
-  }
+bool page_checksum_ok(void* page, uint32_t page_size) {
+  return *node_checksum(page) == page_checksum(page, page_size);
 };
 
 
 
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
-  void* node = get_page(table->pager, page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
 
-  Cursor* cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->page_num = page_num;
 
-  // Binary search
-  uint32_t min = 0;
-  uint32_t max = num_cells;
 
-  while (max != min) {
-    uint32_t idx = (min + max) / 2;
-    uint32_t key_at_index = *leaf_node_key(node, idx);
 
-    // found
-    if (key == key_at_index) {
-      cursor->cell_num = idx;
-      return cursor;
-    }
+/*
+  KEY SEARCH
+*/
 
-    // keep searching
-    if (key < key_at_index) {
-      max = idx;
-    } else {
-      min = idx + 1;
-    }
-  }
 
-  // no match. returns insertion point
-  cursor->cell_num = min;
-  return cursor;
+
+// how many of the sorted `keys` are below `key`: the index of the first key
+// >= `key`. the window is small, so counting every key beats branching
+uint32_t count_keys_below_scalar(const uint32_t* keys, uint32_t num_keys, uint32_t key) {
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < num_keys; i++) {
+    count += keys[i] < key;
+  }
+  return count;
 };
 
 
 
-void create_new_root(Table* table, uint32_t right_child_page_num) {
-  void* root = get_page(table->pager, table->root_page_num);
-  void* right_child = get_page(table->pager, right_child_page_num);
-  uint32_t left_child_page_num = get_unused_page_num(table->pager);
-  void* left_child = get_page(table->pager, left_child_page_num);
+#if defined(__SSE2__)
+// sse2 only compares signed ints: flip the sign bit of both sides first
+uint32_t count_keys_below_sse2(const uint32_t* keys, uint32_t num_keys, uint32_t key) {
+  const __m128i bias = _mm_set1_epi32((int)0x80000000);
+  const __m128i target = _mm_xor_si128(_mm_set1_epi32((int)key), bias);
+  uint32_t count = 0;
+  uint32_t i = 0;
+  for (; i + 4 <= num_keys; i += 4) {
+    __m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(keys + i)), bias);
+    __m128i below = _mm_cmplt_epi32(block, target);
+    count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(below)));
+  }
+  return count + count_keys_below_scalar(keys + i, num_keys - i, key);
+};
+#endif
 
-  // 1. copy root data to left child
-  memcpy(left_child, root, PAGE_SIZE);
-  set_node_root(left_child, false);
 
-  // 2. init new root data
-  initialize_internal_node(root);
-  set_node_root(root, true);
-  *internal_node_num_keys(root) = 1;
 
-  // 3. set up pointers to children
-  *internal_node_child(root, 0) = left_child_page_num;
-  uint32_t left_child_max_key = get_node_max_key(left_child);
-  *internal_node_key(root, 0) = left_child_max_key;
-  *internal_node_right_child(root) = right_child_page_num;
-  *node_parent(left_child) = table->root_page_num;
-  *node_parent(right_child) = table->root_page_num;
+#if defined(KEY_SEARCH_AVX2)
+__attribute__((target("avx2")))
+uint32_t count_keys_below_avx2(const uint32_t* keys, uint32_t num_keys, uint32_t key) {
+  const __m256i bias = _mm256_set1_epi32((int)0x80000000);
+  const __m256i target = _mm256_xor_si256(_mm256_set1_epi32((int)key), bias);
+  uint32_t count = 0;
+  uint32_t i = 0;
+  for (; i + 8 <= num_keys; i += 8) {
+    __m256i block = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(keys + i)), bias);
+    __m256i below = _mm256_cmpgt_epi32(target, block);
+    count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(below)));
+  }
+  return count + count_keys_below_scalar(keys + i, num_keys - i, key);
 };
+#endif
 
 
-uint32_t internal_node_find_child(void* node, uint32_t key) {
- // returns the index of the child which should contain the given key
- uint32_t num_keys = *internal_node_num_keys(node);
-
- uint32_t min = 0;
- uint32_t max = num_keys;
 
- // binary search
- while (min != max) {
-   uint32_t mid = (min + max) / 2;
-   uint32_t key_to_right = *internal_node_key(node, mid);
-   if (key_to_right >= key) {
-     max = mid;
-   } else {
-     min = mid + 1;
-   }
- }
+#if defined(__SSE2__)
+uint32_t (*count_keys_below)(const uint32_t* keys, uint32_t num_keys, uint32_t key) = count_keys_below_sse2;
+#else
+uint32_t (*count_keys_below)(const uint32_t* keys, uint32_t num_keys, uint32_t key) = count_keys_below_scalar;
+#endif
 
- return min;
+// upgrade to avx2 when the cpu has it. called once, when a pager opens
+void key_search_select() {
+#if defined(KEY_SEARCH_AVX2)
+  if (__builtin_cpu_supports("avx2")) {
+    count_keys_below = count_keys_below_avx2;
+  }
+#endif
 };
 
 
 
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
-  void* node = get_page(table->pager, page_num);
-
-  uint32_t child_index = internal_node_find_child(node, key);
-  uint32_t child_num = *internal_node_child(node, child_index);
-
-  void* child = get_page(table->pager, child_num);
-  switch (get_node_type(child)) {
-    case NODE_LEAF:
-      return leaf_node_find(table, child_num, key);
-    case NODE_INTERNAL:
-      return internal_node_find(table, child_num, key);
+// index of the first key >= `key` in a sorted key array
+uint32_t key_lower_bound(const uint32_t* keys, uint32_t num_keys, uint32_t key) {
+  uint32_t min = 0;
+  uint32_t max = num_keys;
+  while (max - min > KEY_SEARCH_WINDOW) {
+    uint32_t mid = (min + max) / 2;
+    if (keys[mid] < key) {
+      min = mid + 1;
+    } else {
+      max = mid;
+    }
   }
+  return min + count_keys_below(keys + min, max - min, key);
 };
 
 
 
 
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
-  uint32_t old_child_index = internal_node_find_child(node, old_key);
-  *internal_node_key(node, old_child_index) = new_key;
-};
-
-
 
-void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num) {
-  // add child/key pair to parent that corresponds to child
-  void* parent = get_page(table->pager, parent_page_num);
-  void* child = get_page(table->pager, child_page_num);
 
-  uint32_t child_max_key = get_node_max_key(child);
-  uint32_t index = internal_node_find_child(parent, child_max_key);
 
-  uint32_t original_num_keys = *internal_node_num_keys(parent);
-  *internal_node_num_keys(parent) = original_num_keys + 1;
+/*
+  PAGER
+*/
 
-  if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-    printf("Need to implement splitting internal node\n");
-    exit(EXIT_FAILURE);
-  }
 
-  uint32_t right_child_page_num = *internal_node_right_child(parent);
-  void* right_child = get_page(table->pager, right_child_page_num);
 
-  if (child_max_key > get_node_max_key(right_child)) {
-    // replace right child
-    *internal_node_child(parent, original_num_keys) = right_child_page_num;
-    *internal_node_key(parent, original_num_keys) = get_node_max_key(right_child);
-    *internal_node_right_child(parent) = child_page_num;
-  } else {
-    // make room for new cell
-    for (uint32_t i = original_num_keys; i > index; i--) {
-      void* dest = internal_node_cell(parent, i);
-      void* src = internal_node_cell(parent, i - 1);
-      memcpy(dest, src, INTERNAL_NODE_CELL_SIZE);
+const NodeLayout* node_layout_for(uint32_t page_size) {
+  for (uint32_t i = 0; i < NUM_NODE_LAYOUTS; i++) {
+    if (NODE_LAYOUTS[i].page_size == page_size) {
+      return &NODE_LAYOUTS[i];
     }
-    *internal_node_child(parent, index) = child_page_num;
-    *internal_node_key(parent, index) = child_max_key;
   }
+  return NULL;
 };
 
 
 
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
-  void* old_node = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t old_max = get_node_max_key(old_node);
-
-  // step 1: make a new node + point to sibling
-  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-  void* new_node = get_page(cursor->table->pager, new_page_num);
-  initialize_leaf_node(new_node);
-  *node_parent(new_node) = *node_parent(old_node);
-  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-  *leaf_node_next_leaf(old_node) = new_page_num;
-
-  // step 2: split all keys (including new one) evenly between old and new node
-  for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-    void* dest_node;
-    // left or right
-    if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-      dest_node = new_node;
-    } else {
-      dest_node = old_node;
-    }
-
-    // align
-    uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-    void* dest = leaf_node_cell(dest_node, index_within_node);
-
-    // write if new entry (key + value) else copy old to new
-    if (i == cursor->cell_num) {
-      serialize_row(
-        value,
-        leaf_node_value(dest_node, index_within_node) // necessary to avoid writing in key space
-      );
-      *leaf_node_key(dest_node, index_within_node) = key;
-    } else if (i > cursor->cell_num) {
-      memcpy(dest, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
-    } else {
-      memcpy(dest, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
-    }
-  }
+// turn O_DIRECT on or off for an open file (F_NOCACHE on macos, which has
+// no O_DIRECT). false if the filesystem refuses
+bool pager_set_direct_io(int fd, bool on) {
+#if defined(O_DIRECT)
+  int flags = fcntl(fd, F_GETFL);
+  stats.syscalls += 2;
+  return flags != -1 && fcntl(fd, F_SETFL, on ? flags | O_DIRECT : flags & ~O_DIRECT) != -1;
+#elif defined(F_NOCACHE)
+  stats.syscalls += 1;
+  return fcntl(fd, F_NOCACHE, on ? 1 : 0) != -1;
+#else
+  return !on;
+#endif
+};
 
-  // step 3: update cell counts in headers
-  *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-  *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
 
-  // step 4: update parent (root or otherwise)
-  if (is_node_root(old_node)) {
-    return create_new_root(cursor->table, new_page_num);
-  } else {
-    uint32_t parent_page_num = *node_parent(old_node);
-    uint32_t new_max = get_node_max_key(old_node);
-    void* parent = get_page(cursor->table->pager, parent_page_num);
 
-    update_internal_node_key(parent, old_max, new_max);
-    internal_node_insert(cursor->table, parent_page_num, new_page_num);
-    return;
+// some filesystems take O_DIRECT and only refuse it (EINVAL) on the first
+// read or write. true if that is what happened and the caller should retry
+// with buffered i/o
+bool pager_direct_io_refused(Pager* pager) {
+  if (!pager->direct_io || errno != EINVAL) {
+    return false;
   }
+  printf("Direct I/O not supported here, using buffered I/O\n");
+  pager->direct_io = false;
+  return pager_set_direct_io(pager->file_descriptor, false);
 };
 
 
 
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
-  void* node = get_page(cursor->table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+// the page size of an existing file comes from its header; `page_size` only
+// applies to a file being created. with `direct_io` the file is opened
+// O_DIRECT, so pages are not cached twice (by the kernel and in the frames).
+// frames are page-aligned and i/o is always whole pages, as O_DIRECT needs
+Pager* pager_open(const char* filename, uint32_t page_size, bool direct_io) {
+  int fd = open(
+    filename,
+    O_RDWR |  // Read/Write mode
+    O_CREAT,  // Create file if it does not exist
+    S_IWUSR | // User write permission
+    S_IRUSR   // User read permission
+  );
 
-  // case 1: split if node is full
-  if (num_cells >= LEAF_NODE_MAX_CELLS) {
-    leaf_node_split_and_insert(cursor, key, value);
-    return;
+  if (fd == -1) {
+    printf("Unable to open file\n");
+    exit(EXIT_FAILURE);
   }
 
-  // case 2: make room at insertion point ("cell_num")
-  if (cursor->cell_num < num_cells) {
-    for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
+  // seek til EOF
+  off_t file_length = lseek(fd, 0, SEEK_END);
+  stats.syscalls += 2;
+
+  // the header is checked in full (checksum included) once it is paged in;
+  // all that is needed here is the page size
+  if (file_length > 0) {
+    char header[HEADER_PAGE_SIZE_OFFSET + HEADER_PAGE_SIZE_SIZE];
+    ssize_t bytes_read = pread(fd, header, sizeof(header), 0);
+    stats.syscalls += 1;
+    if (bytes_read != sizeof(header) || memcmp(header + HEADER_MAGIC_OFFSET, DB_MAGIC, HEADER_MAGIC_SIZE) != 0) {
+      printf("Not a db file. Missing header\n");
+      exit(EXIT_FAILURE);
     }
+    memcpy(&page_size, header + HEADER_PAGE_SIZE_OFFSET, HEADER_PAGE_SIZE_SIZE);
   }
 
-  // increment count of cells
-  *(leaf_node_num_cells(node)) += 1;
+  key_search_select();
 
-  // set key
-  *(leaf_node_key(node, cursor->cell_num)) = key;
+  const NodeLayout* layout = node_layout_for(page_size);
+  if (layout == NULL) {
+    printf("Unsupported page size %d\n", page_size);
+    exit(EXIT_FAILURE);
+  }
 
-  // finally, insert value
-  serialize_row(value, leaf_node_value(node, cursor->cell_num));
-};
+  Pager* pager = malloc(sizeof(Pager));
+  pager->file_descriptor = fd;
+  pager->file_length = file_length;
+  pager->page_size = page_size;
+  pager->layout = layout;
 
+  // switched on only now: the header peek above is not a whole page
+  pager->direct_io = direct_io && pager_set_direct_io(fd, true);
+  if (direct_io && !pager->direct_io) {
+    printf("Direct I/O not supported here, using buffered I/O\n");
+  }
+  pager->num_pages = (file_length / page_size);
 
+  if (file_length % page_size != 0) {
+    printf("Db file is not a whole number of pages. Corrupt file\n");
+    exit(EXIT_FAILURE);
+  }
 
+  // one up-front slab for every frame the pager can ever hold. page-aligned
+  // so frames can be handed straight to O_DIRECT reads and writes
+  if (posix_memalign(&(pager->frames), page_size, (size_t)page_size * TABLE_MAX_PAGES) != 0) {
+    printf("Unable to allocate page frames\n");
+    exit(EXIT_FAILURE);
+  }
+  pager->num_frames_used = 0;
+  pager->free_head = 0;
+  pager->checkpoint_lsn = 0;
+  memset(pager->changed, 0, sizeof(pager->changed));
+  memset(pager->dirty, 0, sizeof(pager->dirty));
+  memset(pager->uses, 0, sizeof(pager->uses));
+  pager->warm_up_len = 0;
+  pager->warm_up_next = 0;
+  pager->backup_path[0] = '\0';
 
+  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+    pager->pages[i] = NULL; // init to null
+  }
+  pager->swizzled = calloc((size_t)TABLE_MAX_PAGES * (INTERNAL_NODE_MAX_CELLS + 1), sizeof(void*));
 
+  return pager;
+};
 
-/*
-  TABLE
-*/
 
 
+// hand out the next unused frame from the slab. pages are never evicted,
+// so every page num claims at most one frame
+void* pager_alloc_frame(Pager* pager) {
+  if (pager->num_frames_used >= TABLE_MAX_PAGES) {
+    printf("Out of page frames\n");
+    exit(EXIT_FAILURE);
+  }
 
+  void* frame = pager->frames + (size_t)pager->num_frames_used * pager->page_size;
+  pager->num_frames_used += 1;
+  return frame;
+};
 
-Table* db_open(char* filename) {
-  Pager* pager = pager_open(filename);
 
-  Table* table = malloc(sizeof(Table));
-  table->pager = pager;
 
-  // New DB file. Initialize page 0 as leaf node.
-  if (pager->num_pages == 0) {
-    void* root_node = get_page(pager, 0);
-    initialize_leaf_node(root_node);
-    set_node_root(root_node, true);
-  }
+// read a page into a frame of its own
+void pager_load_page(Pager* pager, uint32_t page_num) {
+  // claim a frame for page
+  uint32_t page_size = pager->page_size;
+  void* page = pager_alloc_frame(pager);
+  uint32_t num_pages = pager->file_length / page_size;
 
-  return table;
-};
+  // partial page
+  if (pager->file_length % page_size) {
+    num_pages += 1;
+  }
 
+  if (page_num < num_pages) {
+    // set offset to base of page to retrieve
+    lseek(pager->file_descriptor, (off_t)page_num * page_size, SEEK_SET);
 
+    // [disk] read in the full page into "page"
+    ssize_t bytes_read = read(pager->file_descriptor, page, page_size);
+    if (bytes_read == -1 && pager_direct_io_refused(pager)) {
+      bytes_read = pread(pager->file_descriptor, page, page_size, (off_t)page_num * page_size);
+    }
+    if (bytes_read == -1) {
+      printf("Error reading file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    stats.syscalls += 2;
+    if (bytes_read > 0) {
+      stats.pages_read += 1;
+      if (bytes_read < page_size || !page_checksum_ok(page, page_size)) {
+        printf("Page %d failed checksum. Corrupt file\n", page_num);
+        exit(EXIT_FAILURE);
+      }
+    }
 
+    // zero whatever lies past EOF
+    memset(page + bytes_read, 0, page_size - bytes_read);
+  } else {
+    memset(page, 0, page_size);
+  }
 
-void db_close(Table* table) {
-  Pager* pager = table->pager;
+  pager->pages[page_num] = page;
 
-  // flush + free full pages
-  for (uint32_t i = 0; i < pager->num_pages; i++) {
-    if (pager->pages[i] == NULL) {
-      continue;
-    }
-    pager_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
+  if (page_num >= pager->num_pages) {
+    pager->num_pages = page_num + 1;
   }
+};
 
-  // close fd
-  int result = close(pager->file_descriptor);
-  if (result == -1) {
-    printf("Error closing db file\n");
+
+
+void* get_page(Pager* pager, uint32_t page_num) {
+  // case 1: out of bounds page
+  if (page_num >= TABLE_MAX_PAGES) {
+    printf("Cannot fetch out of bounds page number. %d > %d\n", page_num, TABLE_MAX_PAGES);
     exit(EXIT_FAILURE);
   }
 
-  // free ALL pages
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void* page = pager->pages[i];
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
-    }
+  // case 2: no page found aka cache miss
+  if (pager->pages[page_num] == NULL) {
+    stats.cache_misses += 1;
+    pager_load_page(pager, page_num);
+  } else {
+    stats.cache_hits += 1;
   }
+  pager->uses[page_num] += 1;
 
-  // free the pager
-  free(pager);
+  // return pointer to page
+  return pager->pages[page_num];
 };
 
 
 
+// swizzling: a descent remembers the frame behind each child pointer it
+// follows, so the next one through the same internal node goes straight to
+// the child. pages are never evicted, so a slot only goes stale when its
+// parent is rewritten or frames trade page nums
+void** pager_swizzled(Pager* pager, uint32_t page_num) {
+  return pager->swizzled + (size_t)page_num * (INTERNAL_NODE_MAX_CELLS + 1);
+};
 
 
 
-/*
-  CURSOR
-*/
-
+void pager_unswizzle(Pager* pager, uint32_t page_num) {
+  memset(pager_swizzled(pager, page_num), 0, (INTERNAL_NODE_MAX_CELLS + 1) * sizeof(void*));
+};
 
 
-Cursor* table_find(Table* table, uint32_t key) {
-  uint32_t root_page_num = table->root_page_num;
-  void* root_node = get_page(table->pager, root_page_num);
 
-  if (get_node_type(root_node) == NODE_LEAF) {
-    return leaf_node_find(table, root_page_num, key);
-  } else {
-    return internal_node_find(table, root_page_num, key);
-  }
+void pager_unswizzle_all(Pager* pager) {
+  memset(pager->swizzled, 0, (size_t)TABLE_MAX_PAGES * (INTERNAL_NODE_MAX_CELLS + 1) * sizeof(void*));
 };
 
 
 
+// every page that is about to be modified goes through here, so the next
+// incremental backup knows to copy it and the next checkpoint to write it.
+// its children may move, so it also drops its swizzled child frames
+void pager_mark_changed(Pager* pager, uint32_t page_num) {
+  pager->changed[page_num / 8] |= (uint8_t)(1 << (page_num % 8));
+  pager->dirty[page_num / 8] |= (uint8_t)(1 << (page_num % 8));
+  pager_unswizzle(pager, page_num);
+};
 
 
-Cursor* table_start(Table* table) {
-  Cursor* cursor = table_find(table, 0);
 
-  void* node = get_page(table->pager, cursor->page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  cursor->end_of_table = (num_cells == 0);
+bool pager_page_changed(Pager* pager, uint32_t page_num) {
+  return (pager->changed[page_num / 8] >> (page_num % 8)) & 1;
+};
 
-  return cursor;
+
+
+// a page the file does not hold yet is dirty even if nothing marked it
+bool pager_page_dirty(Pager* pager, uint32_t page_num) {
+  if (page_num >= pager->file_length / pager->page_size) {
+    return true;
+  }
+  return (pager->dirty[page_num / 8] >> (page_num % 8)) & 1;
 };
 
 
 
+void* get_page_for_write(Pager* pager, uint32_t page_num) {
+  void* page = get_page(pager, page_num);
+  pager_mark_changed(pager, page_num);
+  return page;
+};
 
-void cursor_advance(Cursor* cursor) {
-  uint32_t page_num = cursor->page_num;
-  void* node = get_page(cursor->table->pager, page_num);
 
-  cursor->cell_num += 1;
 
-  // either the end, or jump to next page (sibling)
-  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-    uint32_t next_page_num = *leaf_node_next_leaf(node);
+void pager_flush(Pager* pager, uint32_t page_num) {
+  if (pager->pages[page_num] == NULL) {
+    printf("Tried to flush null page\n");
+    exit(EXIT_FAILURE);
+  }
+
+  page_update_checksum(pager->pages[page_num], pager->page_size);
+
+  off_t offset = lseek(pager->file_descriptor, (off_t)page_num * pager->page_size, SEEK_SET);
+  if (offset == -1) {
+    printf("Error seeking: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  // PERSIST TO DISK!
+  ssize_t bytes_written = write(pager->file_descriptor, pager->pages[page_num], pager->page_size);
+  if (bytes_written == -1 && pager_direct_io_refused(pager)) {
+    bytes_written = pwrite(pager->file_descriptor, pager->pages[page_num], pager->page_size, offset);
+  }
+  if (bytes_written == -1) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  stats.syscalls += 2;
+  stats.pages_written += 1;
+};
+
+
+uint32_t* free_page_next(void* page) {
+  return page + FREE_PAGE_NEXT_OFFSET;
+};
+
+
+
+// recycle a freed page if there is one, else go to end of db file.
+uint32_t get_unused_page_num(Pager* pager) {
+  if (pager->free_head != 0) {
+    uint32_t page_num = pager->free_head;
+    pager->free_head = *free_page_next(get_page(pager, page_num));
+    return page_num;
+  }
+  return pager->num_pages;
+};
+
+
+
+/*
+  HASH INDEX
+*/
+
+
+
+HashIndex* hash_index_create(uint32_t max_keys) {
+  HashIndex* index = malloc(sizeof(HashIndex));
+  index->num_buckets = 2;
+  index->shift = 31;
+  while (index->num_buckets * HASH_BUCKET_SLOTS < max_keys * 2) {
+    index->num_buckets *= 2;
+    index->shift -= 1;
+  }
+  index->bucket_mask = index->num_buckets - 1;
+
+  size_t size = (size_t)index->num_buckets * sizeof(HashBucket);
+  if (posix_memalign((void**)&(index->buckets), HASH_CACHE_LINE, size) != 0) {
+    printf("Unable to allocate hash index\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(index->buckets, 0, size);
+  return index;
+};
+
+
+
+void hash_index_free(HashIndex* index) {
+  free(index->buckets);
+  free(index);
+};
+
+
+
+// fibonacci hashing, so runs of sequential ids spread over every bucket
+uint32_t hash_index_bucket(HashIndex* index, uint32_t key) {
+  return (key * 2654435769u) >> index->shift;
+};
+
+
+
+// insert or update. empty slots are claimed with a compare-and-swap, so the
+// rebuild at startup can call this from several threads at once
+void hash_index_put(HashIndex* index, uint32_t key, uint32_t page_num, uint32_t cell_num) {
+  uint32_t location = (page_num << 16) | cell_num;
+  uint32_t bucket_num = hash_index_bucket(index, key);
+
+  // at most half full, so the probe always ends
+  while (true) {
+    HashBucket* bucket = &(index->buckets[bucket_num]);
+    for (uint32_t i = 0; i < HASH_BUCKET_SLOTS; i++) {
+      uint32_t current = __atomic_load_n(&(bucket->keys[i]), __ATOMIC_RELAXED);
+      if (current == 0) {
+        // on failure `current` becomes the key that won the slot
+        if (__atomic_compare_exchange_n(&(bucket->keys[i]), &current, key, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+          current = key;
+        }
+      }
+      if (current == key) {
+        bucket->locations[i] = location;
+        return;
+      }
+    }
+    bucket_num = (bucket_num + 1) & index->bucket_mask;
+  }
+};
+
+
+
+// false if the key is not in the table
+bool hash_index_get(HashIndex* index, uint32_t key, uint32_t* page_num, uint32_t* cell_num) {
+  uint32_t bucket_num = hash_index_bucket(index, key);
+
+  while (true) {
+    HashBucket* bucket = &(index->buckets[bucket_num]);
+    for (uint32_t i = 0; i < HASH_BUCKET_SLOTS; i++) {
+      if (bucket->keys[i] == key) {
+        *page_num = bucket->locations[i] >> 16;
+        *cell_num = bucket->locations[i] & 0xffff;
+        return true;
+      }
+      if (bucket->keys[i] == 0) {
+        return false;
+      }
+    }
+    bucket_num = (bucket_num + 1) & index->bucket_mask;
+  }
+};
+
+
+
+/*
+  BLOOM FILTER
+*/
+
+
+
+// sized for `max_keys` at BLOOM_BITS_PER_KEY, rounded up to a power of two
+void bloom_init(BloomFilter* filter, uint32_t max_keys) {
+  uint32_t num_bits = 64;
+  while (num_bits < max_keys * BLOOM_BITS_PER_KEY) {
+    num_bits *= 2;
+  }
+  filter->num_bits = num_bits;
+  filter->bits = calloc(num_bits / 64, sizeof(uint64_t));
+};
+
+
+
+// probes are h1 + i * h2, both halves of one mixed 64-bit hash
+uint64_t bloom_hash(uint32_t key) {
+  uint64_t hash = key;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+};
+
+
+
+void bloom_add(BloomFilter* filter, uint32_t key) {
+  uint64_t hash = bloom_hash(key);
+  uint32_t h1 = hash >> 32;
+  uint32_t h2 = (uint32_t)hash | 1;
+  for (uint32_t i = 0; i < BLOOM_HASHES; i++) {
+    uint32_t bit = (h1 + i * h2) & (filter->num_bits - 1);
+    filter->bits[bit / 64] |= 1ull << (bit % 64);
+  }
+};
+
+
+
+bool bloom_may_contain(BloomFilter* filter, uint32_t key) {
+  uint64_t hash = bloom_hash(key);
+  uint32_t h1 = hash >> 32;
+  uint32_t h2 = (uint32_t)hash | 1;
+  for (uint32_t i = 0; i < BLOOM_HASHES; i++) {
+    uint32_t bit = (h1 + i * h2) & (filter->num_bits - 1);
+    if (((filter->bits[bit / 64] >> (bit % 64)) & 1) == 0) {
+      return false;
+    }
+  }
+  return true;
+};
+
+
+
+
+
+
+/*
+  B-Tree
+*/
+
+
+// node getters + setters (in-place)
+
+
+
+bool is_node_root(void* node) {
+  uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
+  return (bool)value;
+};
+
+
+
+void set_node_root(void* node, bool is_root) {
+  uint8_t value = is_root;
+  *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+};
+
+
+
+NodeType get_node_type(void* node) {
+  uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET)); // casting to uint8_t
+  return (NodeType)value;
+};
+
+
+
+void set_node_type(void* node, NodeType type) {
+  uint8_t value = type;
+  *((uint8_t*)(node + NODE_TYPE_OFFSET)) = value; // casting to uint8_t
+};
+
+
+uint32_t* node_parent(void* node) {
+  return node + PARENT_POINTER_OFFSET;
+};
+
+
+
+uint32_t* internal_node_num_keys(void* node) {
+  return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+};
+
+
+
+uint32_t* internal_node_right_child(void* node) {
+  return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+};
+
+
+
+uint32_t* internal_node_keys(void* node) {
+  return node + INTERNAL_NODE_KEYS_OFFSET;
+};
+
+
+
+// left children only. the right child lives in the header
+uint32_t* internal_node_children(void* node) {
+  return node + INTERNAL_NODE_CHILDREN_OFFSET;
+};
+
+
+
+uint32_t* internal_node_child(void* node, uint32_t child_num) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  if (child_num > num_keys) {
+    printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+    exit(EXIT_FAILURE);
+  } else if (child_num == num_keys) { // one beyond
+    return internal_node_right_child(node);
+  } else { // left_child
+    return internal_node_children(node) + child_num;
+  }
+};
+
+
+
+uint32_t* internal_node_key(void* node, uint32_t key_num) {
+  return internal_node_keys(node) + key_num;
+};
+
+
+
+uint32_t* leaf_node_num_cells(void* node) {
+  return node + LEAF_NODE_NUM_CELLS_OFFSET;
+};
+
+
+
+uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
+  return node + LEAF_NODE_KEYS_OFFSET + cell_num * LEAF_NODE_KEY_SIZE;
+};
+
+
+
+void* leaf_node_value(void* node, uint32_t cell_num, const NodeLayout* layout) {
+  return node + layout->leaf_node_values_offset + cell_num * LEAF_NODE_VALUE_SIZE;
+};
+
+
+
+// keys and values are separate arrays, so moving cells is two moves.
+// source and destination may overlap
+void leaf_node_move_cells(void* dest_node, uint32_t dest, void* src_node, uint32_t src, uint32_t count, const NodeLayout* layout) {
+  memmove(leaf_node_key(dest_node, dest), leaf_node_key(src_node, src), count * LEAF_NODE_KEY_SIZE);
+  memmove(leaf_node_value(dest_node, dest, layout), leaf_node_value(src_node, src, layout), count * LEAF_NODE_VALUE_SIZE);
+};
+
+
+uint32_t* leaf_node_next_leaf(void* node) {
+  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+};
+
+
+
+void initialize_leaf_node(void* node) {
+  set_node_type(node, NODE_LEAF);
+  set_node_root(node, false);     // not root
+  *leaf_node_num_cells(node) = 0; // no children
+  *leaf_node_next_leaf(node) = 0; // no sibling
+};
+
+
+
+void initialize_internal_node(void* node) {
+  set_node_type(node, NODE_INTERNAL);
+  set_node_root(node, false);
+  *internal_node_num_keys(node) = 0;
+};
+
+
+
+void free_page(Pager* pager, uint32_t page_num) {
+  void* node = get_page_for_write(pager, page_num);
+  memset(node, 0, pager->page_size);
+  set_node_type(node, NODE_FREE);
+  *free_page_next(node) = pager->free_head;
+  pager->free_head = page_num;
+};
+
+
+
+uint32_t get_node_max_key(void* node) {
+  switch(get_node_type(node)) {
+    case NODE_INTERNAL: // rightmost key
+      return *internal_node_key(node, *internal_node_num_keys(node) - 1);
+    case NODE_LEAF: // max index
+      return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    default:
+      printf("Tried to get max key of a free page\n");
+      exit(EXIT_FAILURE);
+  }
+};
+
+
+
+// re-point the hash index at a leaf's cells from `from_cell` on, after they
+// were written or moved. there are no deletes, so updates cover everything
+void table_index_leaf(Table* table, uint32_t page_num, uint32_t from_cell) {
+  if (table->hash_index == NULL) {
+    return;
+  }
+  void* node = get_page(table->pager, page_num);
+  if (get_node_type(node) != NODE_LEAF) {
+    return;
+  }
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  for (uint32_t i = from_cell; i < num_cells; i++) {
+    hash_index_put(table->hash_index, *leaf_node_key(node, i), page_num, i);
+  }
+};
+
+
+
+// `node` is the frame of `page_num`, already in hand from the descent
+Cursor leaf_node_find(Table* table, uint32_t page_num, void* node, uint32_t key) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  // cursors live on the caller's stack
+  Cursor cursor;
+  cursor.table = table;
+  cursor.page_num = page_num;
+  cursor.end_of_table = false;
+
+  // the key's cell if present, else its insertion point
+  cursor.cell_num = key_lower_bound(leaf_node_key(node, 0), num_cells, key);
+  return cursor;
+};
+
+
+
+void create_new_root(Table* table, uint32_t right_child_page_num) {
+  void* root = get_page_for_write(table->pager, table->root_page_num);
+  void* right_child = get_page_for_write(table->pager, right_child_page_num);
+  uint32_t left_child_page_num = get_unused_page_num(table->pager);
+  void* left_child = get_page_for_write(table->pager, left_child_page_num);
+
+  // 1. copy root data to left child
+  memcpy(left_child, root, table->pager->page_size);
+  set_node_root(left_child, false);
+
+  // 2. init new root data
+  initialize_internal_node(root);
+  set_node_root(root, true);
+  *internal_node_num_keys(root) = 1;
+
+  // 3. set up pointers to children
+  *internal_node_child(root, 0) = left_child_page_num;
+  uint32_t left_child_max_key = get_node_max_key(left_child);
+  *internal_node_key(root, 0) = left_child_max_key;
+  *internal_node_right_child(root) = right_child_page_num;
+  *node_parent(left_child) = table->root_page_num;
+  *node_parent(right_child) = table->root_page_num;
+
+  // the old root's cells now live on the left child's page
+  table_index_leaf(table, left_child_page_num, 0);
+};
+
+
+uint32_t internal_node_find_child(void* node, uint32_t key) {
+ // returns the index of the child which should contain the given key:
+ // the first one whose key (max key below it) is >= key
+ return key_lower_bound(internal_node_keys(node), *internal_node_num_keys(node), key);
+};
+
+
+
+// frame of child `child_index` of internal node `page_num`, through its
+// swizzled slot once one descent has resolved it. sets *child_page_num
+void* internal_node_child_page(Pager* pager, uint32_t page_num, void* node, uint32_t child_index, uint32_t* child_page_num) {
+  *child_page_num = *internal_node_child(node, child_index);
+
+  void** slot = pager_swizzled(pager, page_num) + child_index;
+  if (*slot == NULL) {
+    *slot = get_page(pager, *child_page_num);
+  } else {
+    stats.swizzle_hits += 1;
+  }
+  return *slot;
+};
+
+
+
+Cursor internal_node_find(Table* table, uint32_t page_num, void* node, uint32_t key) {
+  uint32_t child_index = internal_node_find_child(node, key);
+  uint32_t child_num;
+  void* child = internal_node_child_page(table->pager, page_num, node, child_index, &child_num);
+
+  switch (get_node_type(child)) {
+    case NODE_LEAF:
+      return leaf_node_find(table, child_num, child, key);
+    case NODE_INTERNAL:
+      return internal_node_find(table, child_num, child, key);
+    default:
+      printf("Tree points at free page %d\n", child_num);
+      exit(EXIT_FAILURE);
+  }
+};
+
+
+
+
+void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
+  uint32_t old_child_index = internal_node_find_child(node, old_key);
+  *internal_node_key(node, old_child_index) = new_key;
+};
+
+
+
+void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num) {
+  // add child/key pair to parent that corresponds to child
+  void* parent = get_page_for_write(table->pager, parent_page_num);
+  void* child = get_page(table->pager, child_page_num);
+
+  uint32_t child_max_key = get_node_max_key(child);
+  uint32_t index = internal_node_find_child(parent, child_max_key);
+
+  uint32_t original_num_keys = *internal_node_num_keys(parent);
+  *internal_node_num_keys(parent) = original_num_keys + 1;
+
+  if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
+    printf("Need to implement splitting internal node\n");
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t right_child_page_num = *internal_node_right_child(parent);
+  void* right_child = get_page(table->pager, right_child_page_num);
+
+  if (child_max_key > get_node_max_key(right_child)) {
+    // replace right child
+    *internal_node_child(parent, original_num_keys) = right_child_page_num;
+    *internal_node_key(parent, original_num_keys) = get_node_max_key(right_child);
+    *internal_node_right_child(parent) = child_page_num;
+  } else {
+    // make room for new cell
+    uint32_t num_moved = original_num_keys - index;
+    memmove(internal_node_keys(parent) + index + 1, internal_node_keys(parent) + index, num_moved * INTERNAL_NODE_KEY_SIZE);
+    memmove(internal_node_children(parent) + index + 1, internal_node_children(parent) + index, num_moved * INTERNAL_NODE_CHILD_SIZE);
+    *internal_node_child(parent, index) = child_page_num;
+    *internal_node_key(parent, index) = child_max_key;
+  }
+};
+
+
+
+void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
+  const NodeLayout* layout = cursor->table->pager->layout;
+  uint32_t max_cells = layout->leaf_node_max_cells;
+  void* old_node = get_page_for_write(cursor->table->pager, cursor->page_num);
+  uint32_t old_max = get_node_max_key(old_node);
+
+  // appending to the rightmost leaf: keep the left leaf (nearly) full,
+  // since nothing will ever be inserted into it again
+  bool appending = (cursor->cell_num == max_cells && *leaf_node_next_leaf(old_node) == 0);
+  uint32_t left_split_count = appending ? layout->leaf_node_append_left_split_count : layout->leaf_node_left_split_count;
+  uint32_t right_split_count = (max_cells + 1) - left_split_count;
+
+  // the rightmost leaf is about to change
+  cursor->table->rightmost_leaf_cached = false;
+  stats.node_splits += 1;
+
+  // step 1: make a new node + point to sibling
+  uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
+  void* new_node = get_page_for_write(cursor->table->pager, new_page_num);
+  initialize_leaf_node(new_node);
+  *node_parent(new_node) = *node_parent(old_node);
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+  *leaf_node_next_leaf(old_node) = new_page_num;
+
+  // step 2: split all keys (including new one) between old and new node
+  for (int32_t i = max_cells; i >= 0; i--) {
+    void* dest_node;
+    uint32_t index_within_node;
+    // left or right
+    if (i >= left_split_count) {
+      dest_node = new_node;
+      index_within_node = i - left_split_count;
+    } else {
+      dest_node = old_node;
+      index_within_node = i;
+    }
+
+    // write if new entry (key + value) else copy old to new
+    if (i == cursor->cell_num) {
+      serialize_row(value, leaf_node_value(dest_node, index_within_node, layout));
+      *leaf_node_key(dest_node, index_within_node) = key;
+    } else if (i > cursor->cell_num) {
+      leaf_node_move_cells(dest_node, index_within_node, old_node, i - 1, 1, layout);
+    } else {
+      leaf_node_move_cells(dest_node, index_within_node, old_node, i, 1, layout);
+    }
+  }
+
+  // step 3: update cell counts in headers
+  *(leaf_node_num_cells(old_node)) = left_split_count;
+  *(leaf_node_num_cells(new_node)) = right_split_count;
+  table_index_leaf(cursor->table, cursor->page_num, cursor->cell_num);
+  table_index_leaf(cursor->table, new_page_num, 0);
+
+  // step 4: update parent (root or otherwise)
+  if (is_node_root(old_node)) {
+    return create_new_root(cursor->table, new_page_num);
+  } else {
+    uint32_t parent_page_num = *node_parent(old_node);
+    uint32_t new_max = get_node_max_key(old_node);
+    void* parent = get_page_for_write(cursor->table->pager, parent_page_num);
+
+    update_internal_node_key(parent, old_max, new_max);
+    internal_node_insert(cursor->table, parent_page_num, new_page_num);
+    return;
+  }
+};
+
+
+
+void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
+  const NodeLayout* layout = cursor->table->pager->layout;
+  void* node = get_page_for_write(cursor->table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+
+  // case 1: split if node is full
+  if (num_cells >= layout->leaf_node_max_cells) {
+    leaf_node_split_and_insert(cursor, key, value);
+    return;
+  }
+
+  // case 2: make room at insertion point ("cell_num")
+  if (cursor->cell_num < num_cells) {
+    leaf_node_move_cells(node, cursor->cell_num + 1, node, cursor->cell_num, num_cells - cursor->cell_num, layout);
+  }
+
+  // increment count of cells
+  *(leaf_node_num_cells(node)) += 1;
+
+  // set key
+  *(leaf_node_key(node, cursor->cell_num)) = key;
+
+  // finally, insert value
+  serialize_row(value, leaf_node_value(node, cursor->cell_num, layout));
+  table_index_leaf(cursor->table, cursor->page_num, cursor->cell_num);
+};
+
+
+
+
+
+
+/*
+  LSM
+*/
+
+
+
+void memtable_reset(Memtable* memtable) {
+  arena_reset(&(memtable->arena));
+  memtable->head = arena_alloc(&(memtable->arena), sizeof(SkipNode) + LSM_MAX_HEIGHT * sizeof(SkipNode*));
+  memset(memtable->head->next, 0, LSM_MAX_HEIGHT * sizeof(SkipNode*));
+  memtable->height = 1;
+  memtable->num_rows = 0;
+};
+
+
+
+// room for a full memtable even if every node were as tall as the head
+void memtable_init(Memtable* memtable, uint32_t max_rows) {
+  size_t node_size = sizeof(SkipNode) + LSM_MAX_HEIGHT * sizeof(SkipNode*);
+  arena_init(&(memtable->arena), (max_rows + 1) * node_size);
+  memtable->max_rows = max_rows;
+  memtable->random_state = 0x9E3779B97F4A7C15ull;
+  memtable_reset(memtable);
+};
+
+
+
+// first node with a key >= `key`, or NULL. fills `prev` (if given) with the
+// last node before it on every level
+SkipNode* memtable_find(Memtable* memtable, uint32_t key, SkipNode** prev) {
+  SkipNode* node = memtable->head;
+  for (uint32_t level = memtable->height; level-- > 0;) {
+    while (node->next[level] != NULL && node->next[level]->key < key) {
+      node = node->next[level];
+    }
+    if (prev != NULL) {
+      prev[level] = node;
+    }
+  }
+  return node->next[0];
+};
+
+
+
+// `row` is already serialized. the key must not be in the memtable yet
+void memtable_insert(Memtable* memtable, uint32_t key, const void* row) {
+  SkipNode* prev[LSM_MAX_HEIGHT];
+  memtable_find(memtable, key, prev);
+
+  // each level holds about a quarter of the nodes below it (xorshift64)
+  uint64_t x = memtable->random_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  memtable->random_state = x;
+  uint32_t height = 1;
+  while (height < LSM_MAX_HEIGHT && (x & 3) == 0) {
+    height++;
+    x >>= 2;
+  }
+  for (uint32_t level = memtable->height; level < height; level++) {
+    prev[level] = memtable->head;
+  }
+  if (height > memtable->height) {
+    memtable->height = height;
+  }
+
+  SkipNode* node = arena_alloc(&(memtable->arena), sizeof(SkipNode) + height * sizeof(SkipNode*));
+  node->key = key;
+  memcpy(node->row, row, ROW_SIZE);
+  for (uint32_t level = 0; level < height; level++) {
+    node->next[level] = prev[level]->next[level];
+    prev[level]->next[level] = node;
+  }
+  memtable->num_rows += 1;
+};
+
+
+
+// filters live in memory only: built when a run is written or loaded
+void run_build_filter(Table* table, Run* run) {
+  bloom_init(&(run->bloom), run->num_rows);
+  for (uint32_t p = 0; p < run->num_pages; p++) {
+    void* node = get_page(table->pager, run->pages[p]);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    for (uint32_t i = 0; i < num_cells; i++) {
+      bloom_add(&(run->bloom), *leaf_node_key(node, i));
+    }
+  }
+};
+
+
+
+// add a row (in key order) to the run being written. leaves are filled all
+// the way: runs are never inserted into
+void run_append(Table* table, Run* run, uint32_t key, const void* row) {
+  Pager* pager = table->pager;
+  void* node = NULL;
+  if (run->num_pages > 0) {
+    node = get_page(pager, run->pages[run->num_pages - 1]);
+  }
+
+  if (node == NULL || *leaf_node_num_cells(node) >= pager->layout->leaf_node_max_cells) {
+    uint32_t page_num = get_unused_page_num(pager);
+    void* next = get_page_for_write(pager, page_num);
+    initialize_leaf_node(next);
+    if (node != NULL) {
+      *leaf_node_next_leaf(node) = page_num;
+    }
+    run->pages = realloc(run->pages, (run->num_pages + 1) * sizeof(uint32_t));
+    run->fence_keys = realloc(run->fence_keys, (run->num_pages + 1) * sizeof(uint32_t));
+    run->pages[run->num_pages] = page_num;
+    run->fence_keys[run->num_pages] = key;
+    run->num_pages += 1;
+    node = next;
+  }
+
+  uint32_t cell_num = *leaf_node_num_cells(node);
+  *leaf_node_key(node, cell_num) = key;
+  memcpy(leaf_node_value(node, cell_num, pager->layout), row, LEAF_NODE_VALUE_SIZE);
+  *leaf_node_num_cells(node) = cell_num + 1;
+
+  if (run->num_rows == 0) {
+    run->min_key = key;
+  }
+  run->max_key = key;
+  run->num_rows += 1;
+};
+
+
+
+// a run named by the file header: walk its leaf chain to get back the
+// page list, fence keys and bounds
+void run_load(Table* table, Run* run, uint32_t level, uint32_t first_page, uint32_t num_pages) {
+  Pager* pager = table->pager;
+  memset(run, 0, sizeof(Run));
+  run->level = level;
+  run->pages = malloc(num_pages * sizeof(uint32_t));
+  run->fence_keys = malloc(num_pages * sizeof(uint32_t));
+
+  uint32_t page_num = first_page;
+  for (uint32_t p = 0; p < num_pages; p++) {
+    if (page_num == HEADER_PAGE_NUM || page_num >= pager->num_pages) {
+      printf("Run page %d out of range. Corrupt file\n", page_num);
+      exit(EXIT_FAILURE);
+    }
+    void* node = get_page(pager, page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (get_node_type(node) != NODE_LEAF || num_cells == 0) {
+      printf("Run page %d is not a leaf. Corrupt file\n", page_num);
+      exit(EXIT_FAILURE);
+    }
+
+    run->pages[p] = page_num;
+    run->fence_keys[p] = *leaf_node_key(node, 0);
+    if (p == 0) {
+      run->min_key = *leaf_node_key(node, 0);
+    }
+    run->max_key = *leaf_node_key(node, num_cells - 1);
+    run->num_rows += num_cells;
+    page_num = *leaf_node_next_leaf(node);
+  }
+  run->num_pages = num_pages;
+  run_build_filter(table, run);
+};
+
+
+
+void run_release(Table* table, Run* run, bool free_pages) {
+  if (free_pages) {
+    for (uint32_t p = 0; p < run->num_pages; p++) {
+      free_page(table->pager, run->pages[p]);
+    }
+  }
+  free(run->pages);
+  free(run->fence_keys);
+  free(run->bloom.bits);
+};
+
+
+
+// index of the page that would hold `key`: the last one starting at or below it
+uint32_t run_page_index(Run* run, uint32_t key) {
+  uint32_t i = key_lower_bound(run->fence_keys, run->num_pages, key);
+  if (i < run->num_pages && run->fence_keys[i] == key) {
+    return i;
+  }
+  return i > 0 ? i - 1 : 0;
+};
+
+
+
+void* run_get(Table* table, Run* run, uint32_t key) {
+  if (key < run->min_key || key > run->max_key) {
+    return NULL;
+  }
+  if (!bloom_may_contain(&(run->bloom), key)) {
+    stats.bloom_skips += 1;
+    return NULL;
+  }
+
+  void* node = get_page(table->pager, run->pages[run_page_index(run, key)]);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t cell_num = key_lower_bound(leaf_node_key(node, 0), num_cells, key);
+  if (cell_num < num_cells && *leaf_node_key(node, cell_num) == key) {
+    return leaf_node_value(node, cell_num, table->pager->layout);
+  }
+  return NULL;
+};
+
+
+
+// the row stored under `key`, or NULL. there are no updates or deletes, so
+// a key lives in exactly one place and the search order only matters for speed
+void* lsm_get(Table* table, uint32_t key) {
+  Lsm* lsm = table->lsm;
+  SkipNode* node = memtable_find(&(lsm->memtable), key, NULL);
+  if (node != NULL && node->key == key) {
+    return node->row;
+  }
+  for (uint32_t r = 0; r < lsm->num_runs; r++) {
+    void* row = run_get(table, &(lsm->runs[r]), key);
+    if (row != NULL) {
+      return row;
+    }
+  }
+  return NULL;
+};
+
+
+
+// merge runs [first, first + count) into one run on `level`. they sit next
+// to each other in lsm->runs and the result takes their place
+void lsm_merge_runs(Table* table, uint32_t first, uint32_t count, uint32_t level) {
+  Lsm* lsm = table->lsm;
+  Pager* pager = table->pager;
+  Run* inputs = lsm->runs + first;
+  uint32_t page_index[LSM_MAX_RUNS];
+  uint32_t cell_num[LSM_MAX_RUNS];
+  memset(page_index, 0, sizeof(page_index));
+  memset(cell_num, 0, sizeof(cell_num));
+
+  Run merged;
+  memset(&merged, 0, sizeof(Run));
+  merged.level = level;
+
+  while (true) {
+    // smallest head key among the inputs. they never share a key
+    uint32_t best = count;
+    uint32_t best_key = 0;
+    void* best_node = NULL;
+    for (uint32_t r = 0; r < count; r++) {
+      if (page_index[r] >= inputs[r].num_pages) {
+        continue;
+      }
+      void* node = get_page(pager, inputs[r].pages[page_index[r]]);
+      uint32_t key = *leaf_node_key(node, cell_num[r]);
+      if (best == count || key < best_key) {
+        best = r;
+        best_key = key;
+        best_node = node;
+      }
+    }
+    if (best == count) {
+      break;
+    }
+
+    run_append(table, &merged, best_key, leaf_node_value(best_node, cell_num[best], pager->layout));
+    cell_num[best] += 1;
+    if (cell_num[best] >= *leaf_node_num_cells(best_node)) {
+      page_index[best] += 1;
+      cell_num[best] = 0;
+    }
+  }
+
+  // inputs go to the freelist only now, so the output never lands on them
+  for (uint32_t r = 0; r < count; r++) {
+    run_release(table, &(inputs[r]), true);
+  }
+  run_build_filter(table, &merged);
+
+  lsm->runs[first] = merged;
+  memmove(inputs + 1, inputs + count, (lsm->num_runs - first - count) * sizeof(Run));
+  lsm->num_runs -= count - 1;
+  stats.compactions += 1;
+};
+
+
+
+// leveled compaction, run right after a flush. level 0 past its run limit
+// merges into level 1; a deeper level past its page budget merges into the
+// one below. the last level has no budget
+void lsm_compact(Table* table) {
+  Lsm* lsm = table->lsm;
+
+  uint32_t level0_runs = 0;
+  while (level0_runs < lsm->num_runs && lsm->runs[level0_runs].level == 0) {
+    level0_runs++;
+  }
+  if (level0_runs > LSM_L0_MAX_RUNS) {
+    uint32_t count = level0_runs;
+    if (count < lsm->num_runs && lsm->runs[count].level == 1) {
+      count++;
+    }
+    lsm_merge_runs(table, 0, count, 1);
+  }
+
+  uint32_t r = 0;
+  while (r < lsm->num_runs) {
+    Run* run = &(lsm->runs[r]);
+    uint32_t budget = LSM_MEMTABLE_PAGES;
+    for (uint32_t level = 0; level < run->level; level++) {
+      budget *= LSM_LEVEL_RATIO;
+    }
+    if (run->level == 0 || run->level + 1 >= LSM_MAX_LEVELS || run->num_pages <= budget) {
+      r++;
+      continue;
+    }
+
+    // the merged run lands at r, one level down: check it against that budget
+    uint32_t count = 1;
+    if (r + 1 < lsm->num_runs && lsm->runs[r + 1].level == run->level + 1) {
+      count++;
+    }
+    lsm_merge_runs(table, r, count, run->level + 1);
+  }
+};
+
+
+
+// write the memtable out as the newest level 0 run
+void lsm_flush(Table* table) {
+  Lsm* lsm = table->lsm;
+  Memtable* memtable = &(lsm->memtable);
+  if (memtable->num_rows == 0) {
+    return;
+  }
+
+  Run run;
+  memset(&run, 0, sizeof(Run));
+  for (SkipNode* node = memtable->head->next[0]; node != NULL; node = node->next[0]) {
+    run_append(table, &run, node->key, node->row);
+  }
+  run_build_filter(table, &run);
+
+  memmove(lsm->runs + 1, lsm->runs, lsm->num_runs * sizeof(Run));
+  lsm->runs[0] = run;
+  lsm->num_runs += 1;
+  memtable_reset(memtable);
+  stats.memtable_flushes += 1;
+
+  lsm_compact(table);
+};
+
+
+
+// hand the buffered log records to the file
+void lsm_wal_write(Lsm* lsm) {
+  if (lsm->wal_used == 0) {
+    return;
+  }
+  ssize_t bytes_written = write(lsm->wal_fd, lsm->wal_buffer, lsm->wal_used);
+  stats.syscalls += 1;
+  if (bytes_written != (ssize_t)lsm->wal_used) {
+    printf("Error writing log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  lsm->wal_used = 0;
+};
+
+
+
+// log a row ahead of the memtable. returns the serialized row, which the
+// memtable copies from
+void* lsm_wal_append(Lsm* lsm, uint32_t key, Row* row) {
+  if (lsm->wal_used + LSM_WAL_RECORD_SIZE > LSM_WAL_BUFFER_SIZE) {
+    lsm_wal_write(lsm);
+  }
+
+  char* record = lsm->wal_buffer + lsm->wal_used;
+  memcpy(record, &key, sizeof(uint32_t));
+  serialize_row(row, record + sizeof(uint32_t));
+  uint32_t crc = ~crc32c_update(~0u, (uint8_t*)record, sizeof(uint32_t) + ROW_SIZE);
+  memcpy(record + sizeof(uint32_t) + ROW_SIZE, &crc, sizeof(uint32_t));
+  lsm->wal_used += LSM_WAL_RECORD_SIZE;
+  return record + sizeof(uint32_t);
+};
+
+
+
+// rows logged since the last checkpoint go back into the memtable. a torn
+// record (crash mid-write) ends the log. rows already in a run are skipped,
+// in case the crash came after the checkpoint but before the log was removed
+void lsm_wal_replay(Table* table) {
+  Lsm* lsm = table->lsm;
+  uint32_t per_read = LSM_WAL_BUFFER_SIZE / LSM_WAL_RECORD_SIZE;
+  off_t good_length = 0;
+
+  while (true) {
+    ssize_t bytes_read = pread(lsm->wal_fd, lsm->wal_buffer, (size_t)per_read * LSM_WAL_RECORD_SIZE, good_length);
+    stats.syscalls += 1;
+    if (bytes_read <= 0) {
+      break;
+    }
+
+    uint32_t num_records = bytes_read / LSM_WAL_RECORD_SIZE;
+    uint32_t i = 0;
+    for (; i < num_records; i++) {
+      char* record = lsm->wal_buffer + (size_t)i * LSM_WAL_RECORD_SIZE;
+      uint32_t key;
+      uint32_t crc;
+      memcpy(&key, record, sizeof(uint32_t));
+      memcpy(&crc, record + sizeof(uint32_t) + ROW_SIZE, sizeof(uint32_t));
+      if (crc != ~crc32c_update(~0u, (uint8_t*)record, sizeof(uint32_t) + ROW_SIZE)) {
+        break;
+      }
+      if (lsm_get(table, key) == NULL) {
+        memtable_insert(&(lsm->memtable), key, record + sizeof(uint32_t));
+        if (lsm->memtable.num_rows >= lsm->memtable.max_rows) {
+          lsm_flush(table);
+        }
+      }
+      good_length += LSM_WAL_RECORD_SIZE;
+    }
+    if (i < num_records || bytes_read % LSM_WAL_RECORD_SIZE != 0) {
+      break;
+    }
+  }
+
+  // new records go right after the last good one
+  if (ftruncate(lsm->wal_fd, good_length) == -1) {
+    printf("Error truncating log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  stats.syscalls += 1;
+};
+
+
+
+// the log sits next to the db file as <filename>-wal
+void lsm_open(Table* table, const char* filename) {
+  Lsm* lsm = malloc(sizeof(Lsm));
+  memtable_init(&(lsm->memtable), LSM_MEMTABLE_PAGES * table->pager->layout->leaf_node_max_cells);
+  lsm->num_runs = 0;
+  lsm->wal_used = 0;
+  lsm->wal_buffer = malloc(LSM_WAL_BUFFER_SIZE);
+  snprintf(lsm->wal_path, sizeof(lsm->wal_path), "%s-wal", filename);
+  lsm->wal_fd = open(lsm->wal_path, O_RDWR | O_CREAT | O_APPEND, S_IWUSR | S_IRUSR);
+  stats.syscalls += 1;
+  if (lsm->wal_fd == -1) {
+    printf("Unable to open log file\n");
+    exit(EXIT_FAILURE);
+  }
+  if (crc32c_update == NULL) {
+    crc32c_select();
+  }
+  table->lsm = lsm;
+};
+
+
+
+// after the checkpoint every row is in a run on disk: the log is done
+void lsm_close(Table* table) {
+  Lsm* lsm = table->lsm;
+
+  // the header naming the new runs has to be on disk before the log goes
+  if (fsync(table->pager->file_descriptor) == -1) {
+    printf("Error syncing db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  close(lsm->wal_fd);
+  unlink(lsm->wal_path);
+  stats.syscalls += 3;
+
+  for (uint32_t r = 0; r < lsm->num_runs; r++) {
+    run_release(table, &(lsm->runs[r]), false);
+  }
+  free(lsm->memtable.arena.base);
+  free(lsm->wal_buffer);
+  free(lsm);
+  table->lsm = NULL;
+};
+
+
+
+// pages a statement of `num_rows` may need before the memtable is empty
+// again (counting the flush at close): each flush adds up to
+// LSM_MEMTABLE_PAGES, and a merge holds its inputs until its output is
+// written, at worst every run at once. merging never adds pages
+bool lsm_has_room(Table* table, uint32_t num_rows) {
+  Lsm* lsm = table->lsm;
+  Pager* pager = table->pager;
+  uint32_t max_rows = lsm->memtable.max_rows;
+  uint32_t flushes = (lsm->memtable.num_rows + num_rows + max_rows - 1) / max_rows;
+  uint32_t run_pages = 0;
+  for (uint32_t r = 0; r < lsm->num_runs; r++) {
+    run_pages += lsm->runs[r].num_pages;
+  }
+  uint32_t needed = flushes * LSM_MEMTABLE_PAGES + run_pages + flushes * LSM_MEMTABLE_PAGES;
+
+  uint32_t available = TABLE_MAX_PAGES - pager->num_pages;
+  for (uint32_t page_num = pager->free_head; page_num != 0 && available < needed;) {
+    available += 1;
+    page_num = *free_page_next(get_page(pager, page_num));
+  }
+  return available >= needed;
+};
+
+
+
+// the whole batch is checked before anything is written, so a duplicate
+// inserts nothing. most checks end in the bloom filters
+ExecuteResult lsm_insert(Table* table, RowRef* refs, uint32_t num_rows) {
+  Lsm* lsm = table->lsm;
+  for (uint32_t i = 0; i < num_rows; i++) {
+    if (lsm_get(table, refs[i].key) != NULL) {
+      return EXECUTE_DUPLICATE_KEY;
+    }
+  }
+  if (!lsm_has_room(table, num_rows)) {
+    return EXECUTE_TABLE_FULL;
+  }
+
+  for (uint32_t i = 0; i < num_rows; i++) {
+    void* row = lsm_wal_append(lsm, refs[i].key, refs[i].row);
+    memtable_insert(&(lsm->memtable), refs[i].key, row);
+    if (lsm->memtable.num_rows >= lsm->memtable.max_rows) {
+      lsm_flush(table);
+    }
+  }
+
+  // one write per statement: a crashed process loses nothing, the os may
+  // still hold the log in its cache (it is synced at close)
+  lsm_wal_write(lsm);
+  return EXECUTE_SUCCESS;
+};
+
+
+
+// make the smallest key at the head of any source the scan's current row.
+// false once every source is done
+bool lsm_scan_pick(Table* table) {
+  Lsm* lsm = table->lsm;
+  LsmScan* scan = &(lsm->scan);
+  bool found = false;
+  uint32_t best_key = 0;
+
+  if (scan->node != NULL) {
+    found = true;
+    best_key = scan->node->key;
+    scan->source = LSM_MAX_RUNS;
+    scan->row = scan->node->row;
+  }
+  for (uint32_t r = 0; r < lsm->num_runs; r++) {
+    Run* run = &(lsm->runs[r]);
+    if (scan->page_index[r] >= run->num_pages) {
+      continue;
+    }
+    void* node = get_page(table->pager, run->pages[scan->page_index[r]]);
+    uint32_t key = *leaf_node_key(node, scan->cell_num[r]);
+    if (!found || key < best_key) {
+      found = true;
+      best_key = key;
+      scan->source = r;
+      scan->row = leaf_node_value(node, scan->cell_num[r], table->pager->layout);
+    }
+  }
+  return found;
+};
+
+
+
+// put every source at its first key >= `key`
+bool lsm_scan_seek(Table* table, uint32_t key) {
+  Lsm* lsm = table->lsm;
+  LsmScan* scan = &(lsm->scan);
+  scan->node = memtable_find(&(lsm->memtable), key, NULL);
+
+  for (uint32_t r = 0; r < lsm->num_runs; r++) {
+    Run* run = &(lsm->runs[r]);
+    scan->cell_num[r] = 0;
+    if (key > run->max_key) {
+      scan->page_index[r] = run->num_pages;
+      continue;
+    }
+    uint32_t p = run_page_index(run, key);
+    void* node = get_page(table->pager, run->pages[p]);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t cell_num = key_lower_bound(leaf_node_key(node, 0), num_cells, key);
+    if (cell_num >= num_cells) {
+      // past this page's last key, so the next page (there is one) starts above it
+      p++;
+      cell_num = 0;
+    }
+    scan->page_index[r] = p;
+    scan->cell_num[r] = cell_num;
+  }
+  return lsm_scan_pick(table);
+};
+
+
+
+bool lsm_scan_advance(Table* table) {
+  Lsm* lsm = table->lsm;
+  LsmScan* scan = &(lsm->scan);
+  if (scan->source == LSM_MAX_RUNS) {
+    scan->node = scan->node->next[0];
+  } else {
+    uint32_t r = scan->source;
+    void* node = get_page(table->pager, lsm->runs[r].pages[scan->page_index[r]]);
+    scan->cell_num[r] += 1;
+    if (scan->cell_num[r] >= *leaf_node_num_cells(node)) {
+      scan->page_index[r] += 1;
+      scan->cell_num[r] = 0;
+    }
+  }
+  return lsm_scan_pick(table);
+};
+
+
+
+
+
+
+/*
+  TABLE
+*/
+
+
+
+
+uint16_t* header_version(void* page) {
+  return page + HEADER_VERSION_OFFSET;
+};
+
+
+
+uint32_t* header_page_size(void* page) {
+  return page + HEADER_PAGE_SIZE_OFFSET;
+};
+
+
+
+uint32_t* header_root_page(void* page) {
+  return page + HEADER_ROOT_PAGE_OFFSET;
+};
+
+
+
+uint32_t* header_freelist_head(void* page) {
+  return page + HEADER_FREELIST_HEAD_OFFSET;
+};
+
+
+
+uint32_t* header_page_count(void* page) {
+  return page + HEADER_PAGE_COUNT_OFFSET;
+};
+
+
+
+uint64_t* header_checkpoint_lsn(void* page) {
+  return page + HEADER_CHECKPOINT_LSN_OFFSET;
+};
+
+
+
+uint32_t* header_engine(void* page) {
+  return page + HEADER_ENGINE_OFFSET;
+};
+
+
+
+uint32_t* header_num_runs(void* page) {
+  return page + HEADER_NUM_RUNS_OFFSET;
+};
+
+
+
+// level, first page, page count
+uint32_t* header_run(void* page, uint32_t run_num) {
+  return page + HEADER_RUNS_OFFSET + run_num * HEADER_RUN_SIZE;
+};
+
+
+
+uint32_t* header_num_hot_pages(void* page) {
+  return page + HEADER_NUM_HOT_PAGES_OFFSET;
+};
+
+
+
+// hottest first. only a hint: files from before the list have none
+uint32_t* header_hot_pages(void* page) {
+  return page + HEADER_HOT_PAGES_OFFSET;
+};
+
+
+
+// 0 in files from before version 5: not sharded
+uint32_t* header_num_shards(void* page) {
+  return page + HEADER_NUM_SHARDS_OFFSET;
+};
+
+
+
+uint32_t* header_shard(void* page) {
+  return page + HEADER_SHARD_OFFSET;
+};
+
+
+
+void initialize_header_page(void* page, uint32_t page_size) {
+  memcpy(page + HEADER_MAGIC_OFFSET, DB_MAGIC, HEADER_MAGIC_SIZE);
+  *header_version(page) = DB_FORMAT_VERSION;
+  *header_page_size(page) = page_size;
+};
+
+
+
+// copy the live values into the header frame. anything that writes the
+// header page out (close, backup) calls this first
+void table_sync_header(Table* table) {
+  Pager* pager = table->pager;
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  char before[HEADER_SIZE];
+  memcpy(before, header, sizeof(before));
+
+  *header_version(header) = DB_FORMAT_VERSION;
+  *header_root_page(header) = table->root_page_num;
+  *header_freelist_head(header) = pager->free_head;
+  *header_page_count(header) = pager->num_pages;
+  *header_checkpoint_lsn(header) = pager->checkpoint_lsn;
+  *header_engine(header) = table->lsm != NULL ? ENGINE_LSM : ENGINE_BTREE;
+  *header_num_shards(header) = table->num_shards;
+  *header_shard(header) = table->shard;
+
+  uint32_t num_runs = table->lsm != NULL ? table->lsm->num_runs : 0;
+  *header_num_runs(header) = num_runs;
+  for (uint32_t r = 0; r < num_runs; r++) {
+    Run* run = &(table->lsm->runs[r]);
+    uint32_t* entry = header_run(header, r);
+    entry[0] = run->level;
+    entry[1] = run->pages[0];
+    entry[2] = run->num_pages;
+  }
+  memset(header_run(header, num_runs), 0, (LSM_MAX_RUNS - num_runs) * HEADER_RUN_SIZE);
+
+  // only a header that actually changed goes into the next incremental backup
+  if (memcmp(before, header, sizeof(before)) != 0) {
+    pager_mark_changed(pager, HEADER_PAGE_NUM);
+  }
+};
+
+
+
+// version 1 files did not record their free pages: chain them up by scanning
+void rebuild_freelist(Pager* pager) {
+  for (uint32_t i = pager->num_pages - 1; i > HEADER_PAGE_NUM; i--) {
+    void* node = get_page(pager, i);
+    if (get_node_type(node) == NODE_FREE) {
+      pager_mark_changed(pager, i);
+      *free_page_next(node) = pager->free_head;
+      pager->free_head = i;
+    }
+  }
+};
+
+
+
+// files before version 3 interleaved each key with its value (leaf) or
+// its child (internal). rewrite every node page into separate arrays once
+void upgrade_node_layout(Pager* pager) {
+  char* old = malloc(pager->page_size);
+
+  for (uint32_t page_num = HEADER_PAGE_NUM + 1; page_num < pager->num_pages; page_num++) {
+    void* node = get_page(pager, page_num);
+    NodeType type = get_node_type(node);
+    if (type == NODE_FREE) {
+      continue;
+    }
+    memcpy(old, node, pager->page_size);
+
+    if (type == NODE_LEAF) {
+      for (uint32_t i = 0; i < *leaf_node_num_cells(node); i++) {
+        char* cell = old + LEAF_NODE_HEADER_SIZE + i * LEAF_NODE_CELL_SIZE;
+        memcpy(leaf_node_key(node, i), cell, LEAF_NODE_KEY_SIZE);
+        memcpy(leaf_node_value(node, i, pager->layout), cell + LEAF_NODE_KEY_SIZE, LEAF_NODE_VALUE_SIZE);
+      }
+    } else {
+      for (uint32_t i = 0; i < *internal_node_num_keys(node); i++) {
+        char* cell = old + INTERNAL_NODE_HEADER_SIZE + i * INTERNAL_NODE_CELL_SIZE;
+        memcpy(internal_node_children(node) + i, cell, INTERNAL_NODE_CHILD_SIZE);
+        memcpy(internal_node_keys(node) + i, cell + INTERNAL_NODE_CHILD_SIZE, INTERNAL_NODE_KEY_SIZE);
+      }
+    }
+    pager_mark_changed(pager, page_num);
+  }
+
+  free(old);
+};
+
+
+
+// the pages this session used most go into the header, hottest first, for
+// the next open to warm up with. a session that used nothing keeps the list
+// it was given
+void pager_save_hot_pages(Pager* pager, void* header) {
+  uint32_t hot[HOT_PAGES_MAX];
+  uint32_t num_hot = 0;
+  // free pages are not worth warming up
+  bool taken[TABLE_MAX_PAGES];
+  memset(taken, 0, sizeof(taken));
+  for (uint32_t i = HEADER_PAGE_NUM + 1; i < pager->num_pages; i++) {
+    taken[i] = pager->pages[i] != NULL && get_node_type(pager->pages[i]) == NODE_FREE;
+  }
+
+  while (num_hot < HOT_PAGES_MAX) {
+    uint32_t best = HEADER_PAGE_NUM;
+    for (uint32_t i = HEADER_PAGE_NUM + 1; i < pager->num_pages; i++) {
+      if (!taken[i] && pager->uses[i] > 0 && (best == HEADER_PAGE_NUM || pager->uses[i] > pager->uses[best])) {
+        best = i;
+      }
+    }
+    if (best == HEADER_PAGE_NUM) {
+      break;
+    }
+    taken[best] = true;
+    hot[num_hot++] = best;
+  }
+
+  if (num_hot > 0) {
+    *header_num_hot_pages(header) = num_hot;
+    memcpy(header_hot_pages(header), hot, num_hot * sizeof(uint32_t));
+  }
+};
+
+
+
+// one file as one table. `page_size`, `engine`, `num_shards` and `shard`
+// only apply to a file being created
+Table* db_open_file(char* filename, uint32_t page_size, Engine engine, uint32_t num_shards, uint32_t shard, bool direct_io) {
+  Pager* pager = pager_open(filename, page_size, direct_io);
+
+  Table* table = malloc(sizeof(Table));
+  table->pager = pager;
+  table->root_page_num = ROOT_PAGE_NUM;
+  table->rightmost_leaf_cached = false;
+  table->hash_index = NULL;
+  table->bloom = NULL;
+  table->lsm = NULL;
+  table->shards = NULL;
+  table->num_shards = num_shards;
+  table->shard = shard;
+  table->shard_scan = NULL;
+
+  // New DB file. Write the header and initialize the root as leaf node.
+  // an lsm table has no root: it starts out as an empty memtable. its header
+  // goes to disk right away, so a crash before the first checkpoint still
+  // leaves a file that replays its log. a log left behind by an earlier file
+  // of the same name must not replay into this one
+  if (pager->num_pages == 0) {
+    initialize_header_page(get_page_for_write(pager, HEADER_PAGE_NUM), pager->page_size);
+    if (engine == ENGINE_LSM) {
+      table->root_page_num = HEADER_PAGE_NUM;
+      lsm_open(table, filename);
+      table_sync_header(table);
+      pager_flush(pager, HEADER_PAGE_NUM);
+      pager->file_length = pager->page_size;
+      if (ftruncate(table->lsm->wal_fd, 0) == -1) {
+        printf("Error truncating log: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      stats.syscalls += 1;
+      return table;
+    }
+    void* root_node = get_page_for_write(pager, table->root_page_num);
+    initialize_leaf_node(root_node);
+    set_node_root(root_node, true);
+    return table;
+  }
+
+  // pager_open only peeked at the page size; get_page has now verified the
+  // header's checksum as well. nothing else is read until it is needed
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  uint16_t version = *header_version(header);
+  if (version > DB_FORMAT_VERSION) {
+    printf("Unsupported file format version %d\n", version);
+    exit(EXIT_FAILURE);
+  }
+
+  // files from before version 5 are not sharded
+  table->num_shards = version < 5 ? 1 : *header_num_shards(header);
+  table->shard = version < 5 ? 0 : *header_shard(header);
+
+  // every per-page array is TABLE_MAX_PAGES long. pages past the header's
+  // count may be a torn checkpoint, so only the count itself has to fit
+  if (version == 1) {
+    if (pager->num_pages > TABLE_MAX_PAGES) {
+      printf("Db file has %d pages, more than %d. Corrupt file\n", pager->num_pages, TABLE_MAX_PAGES);
+      exit(EXIT_FAILURE);
+    }
+    rebuild_freelist(pager);
+    upgrade_node_layout(pager);
+    return table;
+  }
+
+  uint32_t page_count = *header_page_count(header);
+  if (page_count > pager->num_pages) {
+    printf("Db file is shorter than its header says. Corrupt file\n");
+    exit(EXIT_FAILURE);
+  }
+  if (page_count > TABLE_MAX_PAGES) {
+    printf("Db file has %d pages, more than %d. Corrupt file\n", page_count, TABLE_MAX_PAGES);
+    exit(EXIT_FAILURE);
+  }
+  // pages past the count never made it into a checkpoint
+  pager->num_pages = page_count;
+  pager->file_length = page_count * pager->page_size;
+
+  table->root_page_num = *header_root_page(header);
+  pager->free_head = *header_freelist_head(header);
+  pager->checkpoint_lsn = *header_checkpoint_lsn(header);
+
+  if (*header_engine(header) == ENGINE_LSM) {
+    uint32_t num_runs = *header_num_runs(header);
+    if (num_runs > LSM_MAX_RUNS) {
+      printf("%d lsm runs is too many. Corrupt file\n", num_runs);
+      exit(EXIT_FAILURE);
+    }
+    lsm_open(table, filename);
+    for (uint32_t r = 0; r < num_runs; r++) {
+      uint32_t* entry = header_run(header, r);
+      run_load(table, &(table->lsm->runs[r]), entry[0], entry[1], entry[2]);
+    }
+    table->lsm->num_runs = num_runs;
+    lsm_wal_replay(table);
+    return table;
+  }
+
+  if (table->root_page_num == HEADER_PAGE_NUM || table->root_page_num >= page_count) {
+    printf("Root page %d out of range. Corrupt file\n", table->root_page_num);
+    exit(EXIT_FAILURE);
+  }
+
+  if (version < 3) {
+    upgrade_node_layout(pager);
+  }
+
+  return table;
+};
+
+
+
+// a sharded table keeps each shard in a file of its own: `filename` itself
+// for shard 0, `filename`-shardN for the others. any of them can live on
+// another disk behind a symlink. `num_shards` only applies to a table being
+// created; otherwise shard 0's header says how many files there are
+Table* db_open(char* filename, uint32_t page_size, Engine engine, uint32_t num_shards, bool direct_io) {
+  struct stat st;
+  bool existed = stat(filename, &st) == 0 && st.st_size > 0;
+  Table* first = db_open_file(filename, page_size, engine, num_shards, 0, direct_io);
+  if (first->shard != 0) {
+    printf("%s is shard %d of another db\n", filename, first->shard);
+    exit(EXIT_FAILURE);
+  }
+  if (first->num_shards <= 1) {
+    return first;
+  }
+  if (first->num_shards > SHARDS_MAX) {
+    printf("%d shards is too many. Corrupt file\n", first->num_shards);
+    exit(EXIT_FAILURE);
+  }
+
+  Table* table = malloc(sizeof(Table));
+  table->pager = NULL;
+  table->root_page_num = HEADER_PAGE_NUM;
+  table->rightmost_leaf_cached = false;
+  table->hash_index = NULL;
+  table->bloom = NULL;
+  table->lsm = NULL;
+  table->num_shards = first->num_shards;
+  table->shard = 0;
+  table->shards = malloc(table->num_shards * sizeof(Table*));
+  table->shard_scan = malloc(sizeof(ShardScan));
+  table->shards[0] = first;
+
+  // shard files come and go with shard 0. one missing would silently drop
+  // its rows, one left from an earlier db would add rows that were not
+  // inserted
+  for (uint32_t s = 1; s < table->num_shards; s++) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s-shard%d", filename, s);
+    bool shard_existed = stat(path, &st) == 0 && st.st_size > 0;
+    if (shard_existed != existed) {
+      printf(existed ? "Shard file %s is missing. Corrupt db\n" : "Shard file %s is left from another db\n", path);
+      exit(EXIT_FAILURE);
+    }
+    Table* shard = db_open_file(path, first->pager->page_size, engine, table->num_shards, s, direct_io);
+    if (shard->num_shards != table->num_shards || shard->shard != s) {
+      printf("Shard file %s does not belong to %s. Corrupt db\n", path, filename);
+      exit(EXIT_FAILURE);
+    }
+    table->shards[s] = shard;
+  }
+  return table;
+};
+
+
+
+
+void db_close(Table* table) {
+  if (table->shards != NULL) {
+    for (uint32_t s = 0; s < table->num_shards; s++) {
+      db_close(table->shards[s]);
+      free(table->shards[s]);
+    }
+    free(table->shards);
+    free(table->shard_scan);
+    table->shards = NULL;
+    return;
+  }
+
+  Pager* pager = table->pager;
+
+  // the memtable goes into a run. until the checkpoint has that run on disk
+  // the log still covers it, so the log is synced first
+  if (table->lsm != NULL) {
+    lsm_wal_write(table->lsm);
+    if (fsync(table->lsm->wal_fd) == -1) {
+      printf("Error syncing log: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    stats.syscalls += 1;
+    lsm_flush(table);
+  }
+
+  // checkpoint: flush dirty pages, then the header that describes them.
+  // pages that were only read are already on disk as they are
+  pager->checkpoint_lsn += 1;
+  table_sync_header(table);
+  pager_save_hot_pages(pager, get_page(pager, HEADER_PAGE_NUM));
+  for (uint32_t i = HEADER_PAGE_NUM + 1; i < pager->num_pages; i++) {
+    if (pager->pages[i] == NULL) {
+      continue;
+    }
+    if (pager_page_dirty(pager, i)) {
+      pager_flush(pager, i);
+    }
+    pager->pages[i] = NULL;
+  }
+  if (fsync(pager->file_descriptor) == -1) {
+    printf("Error syncing db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager_flush(pager, HEADER_PAGE_NUM);
+  pager->pages[HEADER_PAGE_NUM] = NULL;
+  stats.syscalls += 1;
+  if (table->lsm != NULL) {
+    lsm_close(table);
+  }
+
+  // close fd
+  int result = close(pager->file_descriptor);
+  stats.syscalls += 1;
+  if (result == -1) {
+    printf("Error closing db file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // free the frame slab (all pages at once) and the pager
+  free(pager->frames);
+  free(pager->swizzled);
+  if (table->hash_index != NULL) {
+    hash_index_free(table->hash_index);
+    table->hash_index = NULL;
+  }
+  if (table->bloom != NULL) {
+    free(table->bloom->bits);
+    free(table->bloom);
+    table->bloom = NULL;
+  }
+  free(pager);
+};
+
+
+
+// queue a page to be loaded ahead of use and ask the kernel to start
+// reading it now, so the load itself is a copy from the os page cache
+void pager_queue_warm_up(Pager* pager, uint32_t page_num) {
+  if (page_num == HEADER_PAGE_NUM || page_num >= pager->num_pages || pager->pages[page_num] != NULL) {
+    return;
+  }
+  for (uint32_t i = 0; i < pager->warm_up_len; i++) {
+    if (pager->warm_up[i] == page_num) {
+      return;
+    }
+  }
+  pager->warm_up[pager->warm_up_len++] = page_num;
+
+#ifdef POSIX_FADV_WILLNEED
+  if (!pager->direct_io) {
+    posix_fadvise(pager->file_descriptor, (off_t)page_num * pager->page_size, pager->page_size, POSIX_FADV_WILLNEED);
+    stats.syscalls += 1;
+  }
+#endif
+};
+
+
+
+// opening only reads the header. with warm-up the top of the tree and then
+// the last session's hot pages are loaded too, a few at a time, while the
+// repl waits for input
+void table_warm_up_start(Table* table) {
+  if (table->shards != NULL) {
+    for (uint32_t s = 0; s < table->num_shards; s++) {
+      table_warm_up_start(table->shards[s]);
+    }
+    return;
+  }
+  Pager* pager = table->pager;
+  if (table->lsm == NULL) {
+    void* root = get_page(pager, table->root_page_num);
+    if (get_node_type(root) == NODE_INTERNAL) {
+      for (uint32_t i = 0; i < *internal_node_num_keys(root); i++) {
+        pager_queue_warm_up(pager, *internal_node_child(root, i));
+      }
+      pager_queue_warm_up(pager, *internal_node_right_child(root));
+    }
+  }
+
+  void* header = get_page(pager, HEADER_PAGE_NUM);
+  uint32_t num_hot = *header_num_hot_pages(header);
+  for (uint32_t i = 0; i < num_hot && i < HOT_PAGES_MAX; i++) {
+    pager_queue_warm_up(pager, header_hot_pages(header)[i]);
+  }
+};
+
+
+
+void table_warm_up_step(Table* table) {
+  if (table->shards != NULL) {
+    for (uint32_t s = 0; s < table->num_shards; s++) {
+      table_warm_up_step(table->shards[s]);
+    }
+    return;
+  }
+  Pager* pager = table->pager;
+  uint32_t loaded = 0;
+  while (loaded < WARM_UP_STEP_PAGES && pager->warm_up_next < pager->warm_up_len) {
+    uint32_t page_num = pager->warm_up[pager->warm_up_next++];
+    // statements since may have read it already
+    if (pager->pages[page_num] == NULL) {
+      pager_load_page(pager, page_num);
+      stats.pages_warmed += 1;
+      loaded += 1;
+    }
+  }
+};
+
+
+
+
+
+
+/*
+  CURSOR
+*/
+
+
+
+// appends (key past the end of the table) go straight to the cached
+// rightmost leaf without descending. fills `cursor` and returns true if so
+bool table_find_append(Table* table, uint32_t key, Cursor* cursor) {
+  if (!table->rightmost_leaf_cached) {
+    return false;
+  }
+
+  void* node = get_page(table->pager, table->rightmost_leaf_page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  if (num_cells == 0 || key <= *leaf_node_key(node, num_cells - 1)) {
+    return false;
+  }
+
+  cursor->table = table;
+  cursor->page_num = table->rightmost_leaf_page_num;
+  cursor->cell_num = num_cells;
+  cursor->end_of_table = false;
+  return true;
+};
+
+
+
+// remember the leaf a descent ended in if it is the rightmost one
+void table_note_leaf(Table* table, uint32_t page_num) {
+  void* node = get_page(table->pager, page_num);
+  if (*leaf_node_next_leaf(node) == 0) {
+    table->rightmost_leaf_page_num = page_num;
+    table->rightmost_leaf_cached = true;
+  }
+};
+
+
+
+Cursor table_find(Table* table, uint32_t key) {
+  Cursor cursor;
+  if (table_find_append(table, key, &cursor)) {
+    stats.append_fast_paths += 1;
+    return cursor;
+  }
+  stats.tree_descents += 1;
+
+  uint32_t root_page_num = table->root_page_num;
+  void* root_node = get_page(table->pager, root_page_num);
+
+  if (get_node_type(root_node) == NODE_LEAF) {
+    cursor = leaf_node_find(table, root_page_num, root_node, key);
+  } else {
+    cursor = internal_node_find(table, root_page_num, root_node, key);
+  }
+
+  table_note_leaf(table, cursor.page_num);
+  return cursor;
+};
+
+
+
+// like table_find, but also reports the largest key that still belongs in
+// the leaf found, i.e. the nearest separator to the right on the way down
+Cursor table_find_with_limit(Table* table, uint32_t key, uint32_t* key_limit) {
+  Cursor cursor;
+  *key_limit = UINT32_MAX;
+  if (table_find_append(table, key, &cursor)) {
+    stats.append_fast_paths += 1;
+    return cursor;
+  }
+  stats.tree_descents += 1;
+
+  uint32_t page_num = table->root_page_num;
+  void* node = get_page(table->pager, page_num);
+
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_index = internal_node_find_child(node, key);
+    if (child_index < *internal_node_num_keys(node)) {
+      *key_limit = *internal_node_key(node, child_index);
+    }
+    node = internal_node_child_page(table->pager, page_num, node, child_index, &page_num);
+  }
+
+  table_note_leaf(table, page_num);
+  return leaf_node_find(table, page_num, node, key);
+};
+
+
+
+
+
+// which shard holds `key`. rows stay where they were routed, so this must
+// never change for an existing table
+uint32_t shard_of(Table* table, uint32_t key) {
+  return (uint32_t)(bloom_hash(key) % table->num_shards);
+};
+
+
+
+// point lookup: the row stored under `key`, or NULL. with a hash index this
+// is one probe and no descent, since the index holds every key. a bloom
+// filter turns most misses away before either
+void* table_lookup(Table* table, uint32_t key) {
+  if (table->shards != NULL) {
+    return table_lookup(table->shards[shard_of(table, key)], key);
+  }
+  Pager* pager = table->pager;
+  if (table->lsm != NULL) {
+    return lsm_get(table, key);
+  }
+  if (table->bloom != NULL && !bloom_may_contain(table->bloom, key)) {
+    stats.bloom_skips += 1;
+    return NULL;
+  }
+
+  uint32_t page_num;
+  uint32_t cell_num;
+  if (table->hash_index != NULL) {
+    if (!hash_index_get(table->hash_index, key, &page_num, &cell_num)) {
+      return NULL;
+    }
+    stats.hash_index_hits += 1;
+    return leaf_node_value(get_page(pager, page_num), cell_num, pager->layout);
+  }
+
+  Cursor cursor = table_find(table, key);
+  void* node = get_page(pager, cursor.page_num);
+  if (cursor.cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cursor.cell_num) == key) {
+    return leaf_node_value(node, cursor.cell_num, pager->layout);
+  }
+  return NULL;
+};
+
+
+
+void* cursor_value(Cursor* cursor) {
+  if (cursor->table->shards != NULL) {
+    ShardScan* scan = cursor->table->shard_scan;
+    return cursor_value(&(scan->cursors[scan->current]));
+  }
+  if (cursor->table->lsm != NULL) {
+    return cursor->table->lsm->scan.row;
+  }
+
+  uint32_t page_num = cursor->page_num;
+  void* page = get_page(cursor->table->pager, page_num);
+
+  return leaf_node_value(page, cursor->cell_num, cursor->table->pager->layout);
+};
+
+
+
+// point the scan at the shard with the lowest next id. shards hold
+// disjoint keys, so there are no ties. false once every shard is done
+bool shard_scan_pick(Table* table) {
+  ShardScan* scan = table->shard_scan;
+  bool found = false;
+  uint32_t lowest = 0;
+  for (uint32_t s = 0; s < table->num_shards; s++) {
+    if (scan->cursors[s].end_of_table) {
+      continue;
+    }
+    uint32_t id;
+    memcpy(&id, cursor_value(&(scan->cursors[s])) + ID_OFFSET, ID_SIZE);
+    if (!found || id < lowest) {
+      found = true;
+      lowest = id;
+      scan->current = s;
+    }
+  }
+  return found;
+};
+
+
+
+// cursor at the first row with an id >= `key`. on an lsm or sharded table
+// the cursor only marks the end: the position lives in the table's scan
+Cursor table_seek(Table* table, uint32_t key) {
+  if (table->shards != NULL) {
+    for (uint32_t s = 0; s < table->num_shards; s++) {
+      table->shard_scan->cursors[s] = table_seek(table->shards[s], key);
+    }
+    Cursor cursor;
+    cursor.table = table;
+    cursor.page_num = 0;
+    cursor.cell_num = 0;
+    cursor.end_of_table = !shard_scan_pick(table);
+    return cursor;
+  }
+
+  if (table->lsm != NULL) {
+    Cursor cursor;
+    cursor.table = table;
+    cursor.page_num = 0;
+    cursor.cell_num = 0;
+    cursor.end_of_table = !lsm_scan_seek(table, key);
+    return cursor;
+  }
+
+  Cursor cursor = table_find(table, key);
+  void* node = get_page(table->pager, cursor.page_num);
+
+  // past the last key of this leaf: continue in the next one, if any
+  if (cursor.cell_num >= *leaf_node_num_cells(node)) {
+    cursor.page_num = *leaf_node_next_leaf(node);
+    cursor.cell_num = 0;
+    cursor.end_of_table = (cursor.page_num == 0);
+  }
+  return cursor;
+};
+
+
+
+Cursor table_start(Table* table) {
+  if (table->lsm != NULL || table->shards != NULL) {
+    return table_seek(table, 0);
+  }
+
+  Cursor cursor = table_find(table, 0);
+
+  void* node = get_page(table->pager, cursor.page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  cursor.end_of_table = (num_cells == 0);
+
+  return cursor;
+};
+
+
+
+
+void cursor_advance(Cursor* cursor) {
+  if (cursor->table->shards != NULL) {
+    ShardScan* scan = cursor->table->shard_scan;
+    cursor_advance(&(scan->cursors[scan->current]));
+    cursor->end_of_table = !shard_scan_pick(cursor->table);
+    return;
+  }
+
+  if (cursor->table->lsm != NULL) {
+    cursor->end_of_table = !lsm_scan_advance(cursor->table);
+    return;
+  }
+
+  uint32_t page_num = cursor->page_num;
+  void* node = get_page(cursor->table->pager, page_num);
+
+  cursor->cell_num += 1;
+
+  // either the end, or jump to next page (sibling)
+  if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
     if (next_page_num == 0) {
       cursor->end_of_table = true;
     } else {
-      cursor->page_num = next_page_num;
-      cursor->cell_num = 0;
+      cursor->page_num = next_page_num;
+      cursor->cell_num = 0;
+    }
+  }
+};
+
+
+
+
+
+
+
+/*
+  REORGANIZE
+*/
+
+
+
+// index of `child_page_num` among the children of an internal node
+uint32_t internal_node_child_index(void* node, uint32_t child_page_num) {
+  uint32_t num_keys = *internal_node_num_keys(node);
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    if (*internal_node_child(node, i) == child_page_num) {
+      return i;
+    }
+  }
+  printf("Page %d is not a child of its parent\n", child_page_num);
+  exit(EXIT_FAILURE);
+};
+
+
+
+// leaves in key order, following the sibling chain from the leftmost leaf
+uint32_t collect_leaves(Table* table, uint32_t* leaves) {
+  uint32_t page_num = table->root_page_num;
+  void* node = get_page(table->pager, page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    page_num = *internal_node_child(node, 0);
+    node = get_page(table->pager, page_num);
+  }
+
+  uint32_t num_leaves = 0;
+  while (num_leaves < TABLE_MAX_PAGES) {
+    leaves[num_leaves++] = page_num;
+    page_num = *leaf_node_next_leaf(node);
+    if (page_num == 0) {
+      break;
+    }
+    node = get_page(table->pager, page_num);
+  }
+  return num_leaves;
+};
+
+
+
+// fold the right leaf into the left one (same parent, cells fit) and free it
+void merge_leaves(Table* table, uint32_t left_page_num, uint32_t right_page_num) {
+  Pager* pager = table->pager;
+  void* left = get_page_for_write(pager, left_page_num);
+  void* right = get_page(pager, right_page_num);
+  uint32_t parent_page_num = *node_parent(left);
+  void* parent = get_page_for_write(pager, parent_page_num);
+
+  uint32_t left_cells = *leaf_node_num_cells(left);
+  uint32_t right_cells = *leaf_node_num_cells(right);
+  leaf_node_move_cells(left, left_cells, right, 0, right_cells, pager->layout);
+  *leaf_node_num_cells(left) = left_cells + right_cells;
+  *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right);
+  table_index_leaf(table, left_page_num, left_cells);
+
+  // drop the left child's slot; the right one (now pointing at the merged
+  // leaf) keeps the separator that covers both
+  uint32_t num_keys = *internal_node_num_keys(parent);
+  uint32_t index = internal_node_child_index(parent, left_page_num);
+  if (index + 1 == num_keys) {
+    *internal_node_right_child(parent) = left_page_num;
+  } else {
+    *internal_node_child(parent, index + 1) = left_page_num;
+    uint32_t num_moved = num_keys - index - 1;
+    memmove(internal_node_keys(parent) + index, internal_node_keys(parent) + index + 1, num_moved * INTERNAL_NODE_KEY_SIZE);
+    memmove(internal_node_children(parent) + index, internal_node_children(parent) + index + 1, num_moved * INTERNAL_NODE_CHILD_SIZE);
+  }
+  *internal_node_num_keys(parent) = num_keys - 1;
+  free_page(pager, right_page_num);
+
+  // a root left with a single child becomes that child
+  if (parent_page_num == table->root_page_num && num_keys - 1 == 0) {
+    memcpy(parent, left, pager->page_size);
+    set_node_root(parent, true);
+    *node_parent(parent) = 0;
+    free_page(pager, left_page_num);
+    table_index_leaf(table, parent_page_num, 0);
+  }
+};
+
+
+
+uint32_t remap_page_num(uint32_t page_num, uint32_t a, uint32_t b) {
+  if (page_num == a) {
+    return b;
+  } else if (page_num == b) {
+    return a;
+  }
+  return page_num;
+};
+
+
+
+// exchange two leaves' positions in the file. `prev_a`/`prev_b` are their
+// predecessors in the sibling chain (0 for the leftmost leaf)
+void swap_leaf_pages(Table* table, uint32_t a, uint32_t b, uint32_t prev_a, uint32_t prev_b) {
+  Pager* pager = table->pager;
+  get_page_for_write(pager, a);
+  get_page_for_write(pager, b);
+
+  // swapping frames moves the contents without copying. any swizzled slot
+  // may now name the wrong frame
+  void* frame = pager->pages[a];
+  pager->pages[a] = pager->pages[b];
+  pager->pages[b] = frame;
+  pager_unswizzle_all(pager);
+  table_index_leaf(table, a, 0);
+  table_index_leaf(table, b, 0);
+
+  void* node_at_a = pager->pages[a];
+  void* node_at_b = pager->pages[b];
+  *leaf_node_next_leaf(node_at_a) = remap_page_num(*leaf_node_next_leaf(node_at_a), a, b);
+  *leaf_node_next_leaf(node_at_b) = remap_page_num(*leaf_node_next_leaf(node_at_b), a, b);
+
+  // predecessors that are not one of the two leaves themselves
+  if (prev_a != 0 && prev_a != b) {
+    *leaf_node_next_leaf(get_page_for_write(pager, prev_a)) = b;
+  }
+  if (prev_b != 0 && prev_b != a) {
+    *leaf_node_next_leaf(get_page_for_write(pager, prev_b)) = a;
+  }
+
+  // parents are internal nodes, so they did not move
+  uint32_t parents[2] = { *node_parent(node_at_a), *node_parent(node_at_b) };
+  uint32_t num_parents = (parents[0] == parents[1]) ? 1 : 2;
+  for (uint32_t p = 0; p < num_parents; p++) {
+    void* parent = get_page_for_write(pager, parents[p]);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+      uint32_t* child = internal_node_child(parent, i);
+      *child = remap_page_num(*child, a, b);
+    }
+  }
+};
+
+
+
+int compare_page_nums(const void* a, const void* b) {
+  uint32_t page_a = *(const uint32_t*)a;
+  uint32_t page_b = *(const uint32_t*)b;
+  return (page_a > page_b) - (page_a < page_b);
+};
+
+
+
+// one small unit of work: merge one underfull pair of siblings, or move one
+// leaf to its place in key order. false once there is nothing left to do.
+// with `apply` false it only reports whether there is work left
+bool reorganize_step(Table* table, bool apply) {
+  uint32_t leaves[TABLE_MAX_PAGES];
+  uint32_t num_leaves = collect_leaves(table, leaves);
+  if (apply) {
+    table->rightmost_leaf_cached = false;
+  }
+
+  // merges first, so fewer leaves need moving afterwards
+  for (uint32_t j = 0; j + 1 < num_leaves; j++) {
+    void* left = get_page(table->pager, leaves[j]);
+    void* right = get_page(table->pager, leaves[j + 1]);
+    uint32_t left_cells = *leaf_node_num_cells(left);
+    uint32_t right_cells = *leaf_node_num_cells(right);
+
+    const NodeLayout* layout = table->pager->layout;
+    bool underfull = (left_cells < layout->leaf_node_merge_threshold || right_cells < layout->leaf_node_merge_threshold);
+    if (underfull && left_cells + right_cells <= layout->leaf_node_max_cells && *node_parent(left) == *node_parent(right)) {
+      if (apply) {
+        merge_leaves(table, leaves[j], leaves[j + 1]);
+      }
+      return true;
+    }
+  }
+
+  // the j-th leaf in key order belongs on the j-th lowest leaf page
+  uint32_t sorted[TABLE_MAX_PAGES];
+  memcpy(sorted, leaves, num_leaves * sizeof(uint32_t));
+  qsort(sorted, num_leaves, sizeof(uint32_t), compare_page_nums);
+
+  for (uint32_t j = 0; j < num_leaves; j++) {
+    if (leaves[j] != sorted[j]) {
+      uint32_t k = j + 1;
+      while (leaves[k] != sorted[j]) {
+        k++;
+      }
+      if (apply) {
+        swap_leaf_pages(table, leaves[j], leaves[k], j > 0 ? leaves[j - 1] : 0, leaves[k - 1]);
+      }
+      return true;
+    }
+  }
+
+  return false;
+};
+
+
+
+
+
+
+/*
+  BACKUP
+*/
+
+
+
+// pread until `size` bytes or EOF. returns bytes read, -1 on error
+ssize_t read_fully(int fd, void* dest, size_t size, off_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t bytes_read = pread(fd, (char*)dest + done, size - done, offset + done);
+    stats.syscalls += 1;
+    if (bytes_read == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read == -1) {
+      return -1;
+    }
+    if (bytes_read == 0) {
+      break;
+    }
+    done += bytes_read;
+  }
+  return done;
+};
+
+
+
+bool write_fully(int fd, const void* src, size_t size, off_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t bytes_written = pwrite(fd, (const char*)src + done, size - done, offset + done);
+    stats.syscalls += 1;
+    if (bytes_written == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_written == -1) {
+      return false;
+    }
+    done += bytes_written;
+  }
+  return true;
+};
+
+
+
+// copy every page, a chunk at a time: one large sequential read of the db
+// file, overlaid with the cached frames (newer than the disk until close)
+bool backup_full(Pager* pager, int fd) {
+  uint32_t page_size = pager->page_size;
+  size_t chunk_size = (size_t)BACKUP_CHUNK_PAGES * page_size;
+  char* chunk;
+  // page-aligned, so it can be read straight from an O_DIRECT file
+  if (posix_memalign((void**)&chunk, page_size, chunk_size) != 0) {
+    printf("Unable to allocate backup buffer\n");
+    exit(EXIT_FAILURE);
+  }
+  bool ok = true;
+
+  for (uint32_t first = 0; ok && first < pager->num_pages; first += BACKUP_CHUNK_PAGES) {
+    uint32_t count = pager->num_pages - first;
+    if (count > BACKUP_CHUNK_PAGES) {
+      count = BACKUP_CHUNK_PAGES;
+    }
+    off_t offset = (off_t)first * page_size;
+    size_t size = (size_t)count * page_size;
+
+    // skip the read when the whole chunk is cached anyway
+    bool all_cached = true;
+    for (uint32_t i = 0; i < count; i++) {
+      if (pager->pages[first + i] == NULL) {
+        all_cached = false;
+        break;
+      }
+    }
+
+    if (!all_cached) {
+      size_t on_disk = 0;
+      if (offset < pager->file_length) {
+        on_disk = pager->file_length - offset;
+        on_disk = on_disk > size ? size : on_disk;
+      }
+      ssize_t bytes_read = read_fully(pager->file_descriptor, chunk, on_disk, offset);
+      if (bytes_read == -1) {
+        ok = false;
+        break;
+      }
+      memset(chunk + bytes_read, 0, size - bytes_read);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+      if (pager->pages[first + i] != NULL) {
+        memcpy(chunk + (size_t)i * page_size, pager->pages[first + i], page_size);
+        page_update_checksum(chunk + (size_t)i * page_size, page_size);
+      }
+    }
+    ok = write_fully(fd, chunk, size, offset);
+  }
+
+  free(chunk);
+  return ok;
+};
+
+
+
+// copy only pages flagged in the change bitmap. a changed page was written
+// through its frame and frames are never evicted, so each run of changed
+// pages goes out straight from the cache in one pwritev
+bool backup_incremental(Pager* pager, int fd, uint32_t* pages_copied) {
+  uint32_t page_size = pager->page_size;
+  struct iovec iov[BACKUP_CHUNK_PAGES];
+  uint32_t page_num = 0;
+
+  while (page_num < pager->num_pages) {
+    if (!pager_page_changed(pager, page_num)) {
+      page_num++;
+      continue;
+    }
+
+    uint32_t first = page_num;
+    uint32_t count = 0;
+    while (page_num < pager->num_pages && count < BACKUP_CHUNK_PAGES && pager_page_changed(pager, page_num)) {
+      page_update_checksum(pager->pages[page_num], page_size);
+      iov[count].iov_base = pager->pages[page_num];
+      iov[count].iov_len = page_size;
+      count++;
+      page_num++;
+    }
+
+    off_t offset = (off_t)first * page_size;
+    ssize_t bytes_written = pwritev(fd, iov, count, offset);
+    stats.syscalls += 1;
+    if (bytes_written == -1) {
+      return false;
+    }
+
+    // finish a short write page by page
+    for (uint32_t i = bytes_written / page_size; i < count; i++) {
+      size_t done = (i == bytes_written / page_size) ? bytes_written % page_size : 0;
+      if (!write_fully(fd, (char*)iov[i].iov_base + done, page_size - done, offset + (off_t)i * page_size + done)) {
+        return false;
+      }
+    }
+    *pages_copied += count;
+  }
+  return true;
+};
+
+
+
+// .backup <path> [incremental]. statements run one at a time, so a backup
+// taken between two of them always sees a consistent tree
+void backup_table(Table* table, const char* path, bool incremental) {
+  Pager* pager = table->pager;
+  int fd = -1;
+
+  // incremental only makes sense on top of this session's last backup
+  if (incremental) {
+    if (strcmp(path, pager->backup_path) == 0) {
+      fd = open(path, O_WRONLY);
+    }
+    if (fd == -1) {
+      printf("No earlier backup at '%s', taking a full backup.\n", path);
+      incremental = false;
+    }
+  }
+  if (!incremental) {
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  }
+  stats.syscalls += 1;
+  if (fd == -1) {
+    printf("Unable to open backup file '%s'\n", path);
+    return;
+  }
+
+  // the copy gets no log: rows still in the memtable go into a run first
+  if (table->lsm != NULL) {
+    lsm_flush(table);
+  }
+
+  // the copy gets a header that matches the pages going into it
+  table_sync_header(table);
+
+  uint32_t pages_copied = pager->num_pages;
+  bool ok;
+  if (incremental) {
+    pages_copied = 0;
+    ok = backup_incremental(pager, fd, &pages_copied);
+  } else {
+    ok = backup_full(pager, fd);
+  }
+  ok = ok && ftruncate(fd, (off_t)pager->num_pages * pager->page_size) == 0;
+  ok = ok && fsync(fd) == 0;
+  int error = errno;
+  close(fd);
+  stats.syscalls += 3;
+
+  if (!ok) {
+    // the copy is incomplete: never build on it
+    printf("Error writing backup: %d\n", error);
+    pager->backup_path[0] = '\0';
+    return;
+  }
+
+  memset(pager->changed, 0, sizeof(pager->changed));
+  strcpy(pager->backup_path, path);
+  printf(
+    "Backed up %d of %d pages (%s).\n",
+    pages_copied, pager->num_pages, incremental ? "incremental" : "full"
+  );
+};
+
+
+
+
+
+
+
+/*
+  INTEGRITY CHECK
+*/
+
+
+
+// one worker's share of the file
+struct IntegrityJob_t {
+  int fd;
+  uint32_t page_size;
+  uint32_t first_page;
+  uint32_t num_pages;
+  bool* bad; // shared, indexed by page num. workers touch disjoint ranges
+  int io_error; // errno of a failed read (EIO if the file ran short), else 0
+  uint64_t syscalls;
+};
+typedef struct IntegrityJob_t IntegrityJob;
+
+
+
+void* integrity_check_range(void* arg) {
+  IntegrityJob* job = arg;
+  uint32_t page_size = job->page_size;
+  size_t chunk_size = (size_t)BACKUP_CHUNK_PAGES * page_size;
+  char* chunk;
+  if (posix_memalign((void**)&chunk, page_size, chunk_size) != 0) {
+    printf("Unable to allocate check buffer\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (uint32_t done = 0; done < job->num_pages; done += BACKUP_CHUNK_PAGES) {
+    uint32_t count = job->num_pages - done;
+    if (count > BACKUP_CHUNK_PAGES) {
+      count = BACKUP_CHUNK_PAGES;
+    }
+    uint32_t first = job->first_page + done;
+    size_t size = (size_t)count * page_size;
+
+    // large sequential reads. stats are not thread safe, so count locally
+    size_t got = 0;
+    while (got < size) {
+      ssize_t bytes_read = pread(job->fd, chunk + got, size - got, (off_t)first * page_size + got);
+      job->syscalls += 1;
+      if (bytes_read == -1 && errno == EINTR) {
+        continue;
+      }
+      if (bytes_read <= 0) {
+        job->io_error = bytes_read == -1 ? errno : EIO;
+        break;
+      }
+      got += bytes_read;
+    }
+    if (got < size) {
+      break;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+      if (!page_checksum_ok(chunk + (size_t)i * page_size, page_size)) {
+        job->bad[first + i] = true;
+      }
+    }
+  }
+
+  free(chunk);
+  return NULL;
+};
+
+
+
+// verify every page on disk, split into contiguous ranges across threads.
+// pages only in the cache are not on disk yet and have nothing to verify
+void integrity_check(Table* table) {
+  Pager* pager = table->pager;
+  uint32_t num_pages = pager->file_length / pager->page_size;
+
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t num_threads = num_cpus > 0 ? (uint32_t)num_cpus : 1;
+  if (num_threads > INTEGRITY_MAX_THREADS) {
+    num_threads = INTEGRITY_MAX_THREADS;
+  }
+  if (num_threads > num_pages) {
+    num_threads = num_pages > 0 ? num_pages : 1;
+  }
+
+  // pick the crc implementation before the workers race to do it
+  if (crc32c_update == NULL) {
+    crc32c_select();
+  }
+
+  bool bad[TABLE_MAX_PAGES];
+  memset(bad, 0, sizeof(bad));
+  IntegrityJob jobs[INTEGRITY_MAX_THREADS];
+  pthread_t threads[INTEGRITY_MAX_THREADS];
+  bool started[INTEGRITY_MAX_THREADS];
+  uint32_t per_thread = (num_pages + num_threads - 1) / num_threads;
+
+  for (uint32_t t = 0; t < num_threads; t++) {
+    uint32_t first = t * per_thread;
+    jobs[t].fd = pager->file_descriptor;
+    jobs[t].page_size = pager->page_size;
+    jobs[t].first_page = first < num_pages ? first : num_pages;
+    jobs[t].num_pages = first < num_pages ? num_pages - first : 0;
+    if (jobs[t].num_pages > per_thread) {
+      jobs[t].num_pages = per_thread;
+    }
+    jobs[t].bad = bad;
+    jobs[t].io_error = 0;
+    jobs[t].syscalls = 0;
+    started[t] = pthread_create(&threads[t], NULL, integrity_check_range, &jobs[t]) == 0;
+    if (!started[t]) {
+      // no thread to spare: check this range ourselves
+      integrity_check_range(&jobs[t]);
+    }
+  }
+
+  int io_error = 0;
+  for (uint32_t t = 0; t < num_threads; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    }
+    if (io_error == 0) {
+      io_error = jobs[t].io_error;
+    }
+    stats.syscalls += jobs[t].syscalls;
+  }
+
+  uint32_t num_bad = 0;
+  for (uint32_t i = 0; i < num_pages; i++) {
+    if (bad[i]) {
+      printf("page %d: checksum mismatch\n", i);
+      num_bad++;
+    }
+  }
+  if (io_error != 0) {
+    printf("Error reading db file: %d\n", io_error);
+  }
+  printf("Integrity check: %d pages, %d bad.\n", num_pages, num_bad);
+};
+
+
+
+
+
+
+
+/*
+  HASH INDEX BUILD
+*/
+
+
+// each worker indexes a slice of the leaves. frames are only read, and
+// index slots are claimed atomically, so the workers share no lock
+struct HashIndexJob_t {
+  HashIndex* index;
+  Pager* pager;
+  uint32_t* leaves;
+  uint32_t num_leaves;
+};
+typedef struct HashIndexJob_t HashIndexJob;
+
+
+
+void* hash_index_fill(void* arg) {
+  HashIndexJob* job = arg;
+  for (uint32_t l = 0; l < job->num_leaves; l++) {
+    uint32_t page_num = job->leaves[l];
+    void* node = job->pager->pages[page_num];
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    for (uint32_t i = 0; i < num_cells; i++) {
+      hash_index_put(job->index, *leaf_node_key(node, i), page_num, i);
+    }
+  }
+  return NULL;
+};
+
+
+
+// index every row with one parallel pass over the leaves. collect_leaves
+// pages them all in first, since get_page is not thread safe
+void table_build_hash_index(Table* table) {
+  if (table->shards != NULL) {
+    for (uint32_t s = 0; s < table->num_shards; s++) {
+      table_build_hash_index(table->shards[s]);
+    }
+    return;
+  }
+  Pager* pager = table->pager;
+  if (table->lsm != NULL) {
+    printf("Hash index is only kept for b-tree tables\n");
+    return;
+  }
+  table->hash_index = hash_index_create(TABLE_MAX_PAGES * pager->layout->leaf_node_max_cells);
+
+  uint32_t leaves[TABLE_MAX_PAGES];
+  uint32_t num_leaves = collect_leaves(table, leaves);
+
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t num_threads = num_cpus > 0 ? (uint32_t)num_cpus : 1;
+  if (num_threads > HASH_INDEX_MAX_THREADS) {
+    num_threads = HASH_INDEX_MAX_THREADS;
+  }
+  if (num_threads > num_leaves) {
+    num_threads = num_leaves;
+  }
+
+  HashIndexJob jobs[HASH_INDEX_MAX_THREADS];
+  pthread_t threads[HASH_INDEX_MAX_THREADS];
+  bool started[HASH_INDEX_MAX_THREADS];
+  uint32_t per_thread = (num_leaves + num_threads - 1) / num_threads;
+
+  for (uint32_t t = 0; t < num_threads; t++) {
+    uint32_t first = t * per_thread;
+    jobs[t].index = table->hash_index;
+    jobs[t].pager = pager;
+    jobs[t].leaves = leaves + (first < num_leaves ? first : num_leaves);
+    jobs[t].num_leaves = first < num_leaves ? num_leaves - first : 0;
+    if (jobs[t].num_leaves > per_thread) {
+      jobs[t].num_leaves = per_thread;
+    }
+    started[t] = pthread_create(&threads[t], NULL, hash_index_fill, &jobs[t]) == 0;
+    if (!started[t]) {
+      // no thread to spare: index this slice ourselves
+      hash_index_fill(&jobs[t]);
+    }
+  }
+
+  for (uint32_t t = 0; t < num_threads; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+};
+
+
+
+
+
+
+
+/*
+  BLOOM FILTER BUILD
+*/
+
+
+
+// --bloom: one filter over every key in the tree, sized for a full table.
+// it lives in memory only and is rebuilt from the leaves at each open
+void table_build_bloom(Table* table) {
+  if (table->shards != NULL) {
+    for (uint32_t s = 0; s < table->num_shards; s++) {
+      table_build_bloom(table->shards[s]);
+    }
+    return;
+  }
+  Pager* pager = table->pager;
+  if (table->lsm != NULL) {
+    printf("Bloom filter is only kept for b-tree tables (lsm runs have their own)\n");
+    return;
+  }
+  table->bloom = malloc(sizeof(BloomFilter));
+  bloom_init(table->bloom, TABLE_MAX_PAGES * pager->layout->leaf_node_max_cells);
+
+  uint32_t leaves[TABLE_MAX_PAGES];
+  uint32_t num_leaves = collect_leaves(table, leaves);
+  for (uint32_t l = 0; l < num_leaves; l++) {
+    void* node = get_page(pager, leaves[l]);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    for (uint32_t i = 0; i < num_cells; i++) {
+      bloom_add(table->bloom, *leaf_node_key(node, i));
+    }
+  }
+};
+
+
+
+
+
+
+
+/*
+  SHARD PAGE-IN
+*/
+
+
+// read every page of one shard that is not in a frame yet. only this worker
+// touches the shard's pager. a page that fails to read or to checksum is
+// left for get_page to load, and to report, later
+void* shard_page_in(void* arg) {
+  ShardJob* job = arg;
+  Pager* pager = job->pager;
+  uint32_t page_size = pager->page_size;
+  uint32_t on_disk = pager->file_length / page_size;
+
+  for (uint32_t page_num = HEADER_PAGE_NUM + 1; page_num < on_disk; page_num++) {
+    if (pager->pages[page_num] != NULL) {
+      continue;
+    }
+    // the next free frame, claimed only once the page checks out
+    void* frame = pager->frames + (size_t)pager->num_frames_used * page_size;
+    ssize_t bytes_read = pread(pager->file_descriptor, frame, page_size, (off_t)page_num * page_size);
+    job->syscalls += 1;
+    if (bytes_read != page_size || !page_checksum_ok(frame, page_size)) {
+      continue;
+    }
+    pager->num_frames_used += 1;
+    pager->pages[page_num] = frame;
+    job->pages_read += 1;
+  }
+  return NULL;
+};
+
+
+
+bool pager_fully_cached(Pager* pager) {
+  uint32_t on_disk = pager->file_length / pager->page_size;
+  for (uint32_t page_num = HEADER_PAGE_NUM + 1; page_num < on_disk; page_num++) {
+    if (pager->pages[page_num] == NULL) {
+      return false;
+    }
+  }
+  return true;
+};
+
+
+
+// before a scan over every shard: a worker per shard reads it in, so the
+// files are read at the same time (from separate disks, if they are on
+// separate disks). the merge that follows then runs from memory
+void table_page_in_shards(Table* table) {
+  ShardJob jobs[SHARDS_MAX];
+  pthread_t threads[SHARDS_MAX];
+  bool started[SHARDS_MAX];
+
+  for (uint32_t s = 0; s < table->num_shards; s++) {
+    jobs[s].pager = table->shards[s]->pager;
+    jobs[s].pages_read = 0;
+    jobs[s].syscalls = 0;
+    started[s] = false;
+    if (pager_fully_cached(jobs[s].pager)) {
+      continue;
+    }
+    started[s] = pthread_create(&threads[s], NULL, shard_page_in, &jobs[s]) == 0;
+    if (!started[s]) {
+      // no thread to spare: read this shard ourselves
+      shard_page_in(&jobs[s]);
+    }
+  }
+
+  for (uint32_t s = 0; s < table->num_shards; s++) {
+    if (started[s]) {
+      pthread_join(threads[s], NULL);
+    }
+    stats.pages_read += jobs[s].pages_read;
+    stats.syscalls += jobs[s].syscalls;
+  }
+};
+
+
+
+
+
+
+
+/*
+  STATEMENT
+*/
+
+
+
+void init_statement(Statement* statement) {
+  arena_init(&(statement->arena), STATEMENT_ARENA_SIZE);
+  statement->rows = NULL;
+  statement->num_rows = 0;
+  statement->select_id = 0;
+  statement->num_columns = 0;
+  statement->grouped = false;
+  statement->order_by = SORT_NONE;
+  statement->descending = false;
+  statement->limit = UINT32_MAX;
+};
+
+
+
+// drop everything the last statement allocated
+void reset_statement(Statement* statement) {
+  arena_reset(&(statement->arena));
+  statement->rows = NULL;
+  statement->num_rows = 0;
+  statement->select_id = 0;
+  statement->num_columns = 0;
+  statement->grouped = false;
+  statement->order_by = SORT_NONE;
+  statement->descending = false;
+  statement->limit = UINT32_MAX;
+};
+
+
+
+// append a row slot to the statement. rows stay contiguous because nothing
+// else is carved from the arena while an insert is being prepared
+Row* statement_push_row(Statement* statement) {
+  // leave room for the sort refs execute_insert allocates after the rows
+  if (statement->num_rows >= STATEMENT_ARENA_SIZE / (sizeof(Row) + sizeof(RowRef)) - 1) {
+    return NULL;
+  }
+
+  Row* row = arena_alloc(&(statement->arena), sizeof(Row));
+  if (row == NULL) {
+    return NULL;
+  }
+
+  if (statement->num_rows == 0) {
+    statement->rows = row;
+  } else if (row != statement->rows + statement->num_rows) {
+    return NULL;
+  }
+
+  statement->num_rows += 1;
+  return row;
+};
+
+
+
+
+/*
+  PREPARE STATEMENT
+*/
+
+
+
+// returns the first of a, b or c in [p, end), or end. compares 16 bytes at a
+// time where SSE2 is available
+const char* scan_until(const char* p, const char* end, char a, char b, char c) {
+#if defined(__SSE2__)
+  __m128i va = _mm_set1_epi8(a);
+  __m128i vb = _mm_set1_epi8(b);
+  __m128i vc = _mm_set1_epi8(c);
+
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+    __m128i hits = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)),
+      _mm_cmpeq_epi8(chunk, vc)
+    );
+    int mask = _mm_movemask_epi8(hits);
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#endif
+
+  while (p < end && *p != a && *p != b && *p != c) {
+    p++;
+  }
+  return p;
+};
+
+
+
+void skip_spaces(Scanner* scanner) {
+  while (scanner->pos < scanner->end && *(scanner->pos) == ' ') {
+    scanner->pos++;
+  }
+};
+
+
+
+// consume `c` (after any spaces). false if it is not next
+bool scan_char(Scanner* scanner, char c) {
+  skip_spaces(scanner);
+  if (scanner->pos < scanner->end && *(scanner->pos) == c) {
+    scanner->pos++;
+    return true;
+  }
+  return false;
+};
+
+
+
+// consume the next word if it matches `word` exactly
+bool scan_keyword(Scanner* scanner, const char* word) {
+  skip_spaces(scanner);
+  size_t length = strlen(word);
+  const char* word_end = scanner->pos + length;
+
+  if (word_end > scanner->end || memcmp(scanner->pos, word, length) != 0) {
+    return false;
+  }
+  if (word_end < scanner->end && *word_end != ' ' && *word_end != '(' && *word_end != '=') {
+    return false;
+  }
+
+  scanner->pos = word_end;
+  return true;
+};
+
+
+
+// parse and validate an id in one pass over its digits
+PrepareResult scan_id(Scanner* scanner, const char* token_end, uint32_t* id) {
+  const char* p = scanner->pos;
+  if (p == token_end) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  bool negative = (*p == '-');
+  if (negative) {
+    p++;
+  }
+
+  uint64_t value = 0;
+  for (; p < token_end; p++) {
+    if (*p < '0' || *p > '9') {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    value = value * 10 + (*p - '0');
+    if (value > INT32_MAX) {
+      return negative ? PREPARE_NEGATIVE_ID : PREPARE_SYNTAX_ERROR;
+    }
+  }
+
+  if (negative || value == 0) {
+    return PREPARE_NEGATIVE_ID;
+  }
+
+  *id = (uint32_t)value;
+  scanner->pos = token_end;
+  return PREPARE_SUCCESS;
+};
+
+
+
+// copy a token into a fixed-size column, checking its length on the way
+PrepareResult scan_column(Scanner* scanner, const char* token_end, char* dest, uint32_t max_length) {
+  size_t length = token_end - scanner->pos;
+  if (length == 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (length > max_length) {
+    return PREPARE_STRING_TOO_LONG;
+  }
+
+  // zero the tail too, so stored (and binary exported) rows carry no stale bytes
+  memcpy(dest, scanner->pos, length);
+  memset(dest + length, 0, max_length + 1 - length);
+  scanner->pos = token_end;
+  return PREPARE_SUCCESS;
+};
+
+
+
+// insert <id> <username> <email>
+PrepareResult prepare_insert_single(Scanner* scanner, Statement* statement) {
+  Row* row = statement_push_row(statement);
+  if (row == NULL) {
+    return PREPARE_TOO_MANY_ROWS;
+  }
+
+  PrepareResult result;
+
+  skip_spaces(scanner);
+  result = scan_id(scanner, scan_until(scanner->pos, scanner->end, ' ', ' ', ' '), &(row->id));
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+
+  skip_spaces(scanner);
+  result = scan_column(scanner, scan_until(scanner->pos, scanner->end, ' ', ' ', ' '), row->username, COL_USERNAME_SIZE);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+
+  skip_spaces(scanner);
+  result = scan_column(scanner, scan_until(scanner->pos, scanner->end, ' ', ' ', ' '), row->email, COL_EMAIL_SIZE);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+
+  // like before, anything after the email is ignored
+  return PREPARE_SUCCESS;
+};
+
+
+
+// insert values (<id>, <username>, <email>), (...), ...
+PrepareResult prepare_insert_values(Scanner* scanner, Statement* statement) {
+  PrepareResult result;
+
+  do {
+    if (!scan_char(scanner, '(')) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+
+    Row* row = statement_push_row(statement);
+    if (row == NULL) {
+      return PREPARE_TOO_MANY_ROWS;
+    }
+
+    skip_spaces(scanner);
+    result = scan_id(scanner, scan_until(scanner->pos, scanner->end, ' ', ',', ')'), &(row->id));
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    if (!scan_char(scanner, ',')) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+
+    skip_spaces(scanner);
+    result = scan_column(scanner, scan_until(scanner->pos, scanner->end, ' ', ',', ')'), row->username, COL_USERNAME_SIZE);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    if (!scan_char(scanner, ',')) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+
+    skip_spaces(scanner);
+    result = scan_column(scanner, scan_until(scanner->pos, scanner->end, ' ', ',', ')'), row->email, COL_EMAIL_SIZE);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    if (!scan_char(scanner, ')')) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  } while (scan_char(scanner, ','));
+
+  skip_spaces(scanner);
+  if (scanner->pos != scanner->end) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  return PREPARE_SUCCESS;
+};
+
+
+
+PrepareResult prepare_insert(Scanner* scanner, Statement* statement) {
+  statement->type = STATEMENT_INSERT;
+
+  if (scan_keyword(scanner, "values")) {
+    return prepare_insert_values(scanner, statement);
+  }
+  return prepare_insert_single(scanner, statement);
+};
+
+// one of SELECT_COLUMN_NAMES, ending at a space, a comma or the line end
+bool scan_select_column(Scanner* scanner, SelectColumn* column) {
+  skip_spaces(scanner);
+  for (uint32_t i = 0; i < NUM_SELECT_COLUMN_NAMES; i++) {
+    size_t length = strlen(SELECT_COLUMN_NAMES[i]);
+    const char* name_end = scanner->pos + length;
+    if (name_end > scanner->end || memcmp(scanner->pos, SELECT_COLUMN_NAMES[i], length) != 0) {
+      continue;
+    }
+    if (name_end < scanner->end && *name_end != ' ' && *name_end != ',') {
+      continue;
+    }
+    scanner->pos = name_end;
+    *column = (SelectColumn)i;
+    return true;
+  }
+  return false;
+};
+
+
+
+// select column, ... [group by username|email]. text columns must be the
+// group by column, everything else is an aggregate
+PrepareResult prepare_select_aggregate(Scanner* scanner, Statement* statement) {
+  do {
+    if (statement->num_columns == SELECT_MAX_COLUMNS) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (!scan_select_column(scanner, &(statement->columns[statement->num_columns]))) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    statement->num_columns++;
+  } while (scan_char(scanner, ','));
+
+  if (scan_keyword(scanner, "group")) {
+    if (!scan_keyword(scanner, "by") || !scan_select_column(scanner, &(statement->group_by))) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (statement->group_by != COLUMN_USERNAME && statement->group_by != COLUMN_EMAIL) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    statement->grouped = true;
+  }
+
+  for (uint32_t i = 0; i < statement->num_columns; i++) {
+    SelectColumn column = statement->columns[i];
+    bool text = (column == COLUMN_USERNAME || column == COLUMN_EMAIL);
+    if (text && (!statement->grouped || column != statement->group_by)) {
+      return PREPARE_NOT_GROUPED;
+    }
+  }
+
+  skip_spaces(scanner);
+  return scanner->pos == scanner->end ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+};
+
+
+
+// [order by id|username|email [asc|desc]] [limit K], after a whole-row select
+PrepareResult prepare_select_order(Scanner* scanner, Statement* statement) {
+  if (scan_keyword(scanner, "order")) {
+    if (!scan_keyword(scanner, "by")) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (scan_keyword(scanner, "id")) {
+      statement->order_by = SORT_ID;
+    } else if (scan_keyword(scanner, "username")) {
+      statement->order_by = SORT_USERNAME;
+    } else if (scan_keyword(scanner, "email")) {
+      statement->order_by = SORT_EMAIL;
+    } else {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (scan_keyword(scanner, "desc")) {
+      statement->descending = true;
+    } else {
+      scan_keyword(scanner, "asc");
+    }
+  }
+
+  if (scan_keyword(scanner, "limit")) {
+    skip_spaces(scanner);
+    // a limit reads like an id: a positive 32 bit number
+    if (scan_id(scanner, scan_until(scanner->pos, scanner->end, ' ', ' ', ' '), &(statement->limit)) != PREPARE_SUCCESS) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+
+  skip_spaces(scanner);
+  return scanner->pos == scanner->end ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+};
+
+
+
+// select [order by ...] [limit K] | select where id = N |
+// select column, ... [group by column]
+PrepareResult prepare_select(Scanner* scanner, Statement* statement) {
+  statement->type = STATEMENT_SELECT;
+
+  skip_spaces(scanner);
+  if (scanner->pos == scanner->end) {
+    return PREPARE_SUCCESS;
+  }
+  const char* clause = scanner->pos;
+  if (scan_keyword(scanner, "order") || scan_keyword(scanner, "limit")) {
+    scanner->pos = clause;
+    return prepare_select_order(scanner, statement);
+  }
+  if (!scan_keyword(scanner, "where")) {
+    return prepare_select_aggregate(scanner, statement);
+  }
+
+  if (!scan_keyword(scanner, "id") || !scan_char(scanner, '=')) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  skip_spaces(scanner);
+  PrepareResult result = scan_id(scanner, scan_until(scanner->pos, scanner->end, ' ', ' ', ' '), &(statement->select_id));
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+
+  skip_spaces(scanner);
+  return scanner->pos == scanner->end ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+};
+
+PrepareResult prepare_statement(Buffer* buf, Statement* statement) {
+  Scanner scanner;
+  scanner.pos = buf->line;
+  scanner.end = buf->line + buf->input_length;
+
+  if (scan_keyword(&scanner, "insert")) {
+    return prepare_insert(&scanner, statement);
+  }
+
+  if (scan_keyword(&scanner, "select")) {
+    return prepare_select(&scanner, statement);
+  }
+
+  // otherwise
+  return PREPARE_UNRECOGNIZED;
+}
+
+
+
+
+
+
+
+/*
+  AGGREGATE
+*/
+
+
+
+void aggregate_init(AggregateTable* agg, uint32_t depth) {
+  agg->num_slots = 1024;
+  agg->slots = calloc(agg->num_slots, sizeof(uint32_t));
+  agg->groups_capacity = 256;
+  agg->groups = malloc(agg->groups_capacity * sizeof(AggregateGroup));
+  agg->num_groups = 0;
+  agg->keys_capacity = 4096;
+  agg->keys = malloc(agg->keys_capacity);
+  agg->keys_used = 0;
+  agg->depth = depth;
+  for (uint32_t p = 0; p < AGGREGATE_SPILL_PARTITIONS; p++) {
+    agg->spills[p] = NULL;
+  }
+};
+
+
+
+void aggregate_free(AggregateTable* agg) {
+  for (uint32_t p = 0; p < AGGREGATE_SPILL_PARTITIONS; p++) {
+    if (agg->spills[p] != NULL) {
+      fclose(agg->spills[p]);
+    }
+  }
+  free(agg->slots);
+  free(agg->groups);
+  free(agg->keys);
+};
+
+
+
+uint32_t aggregate_hash(const char* key, uint32_t length) {
+  if (crc32c_update == NULL) {
+    crc32c_select();
+  }
+  return ~crc32c_update(~0u, (const uint8_t*)key, length);
+};
+
+
+
+// double the slot directory once it is half full
+void aggregate_grow_slots(AggregateTable* agg) {
+  free(agg->slots);
+  agg->num_slots *= 2;
+  agg->slots = calloc(agg->num_slots, sizeof(uint32_t));
+
+  uint32_t mask = agg->num_slots - 1;
+  for (uint32_t g = 0; g < agg->num_groups; g++) {
+    uint32_t slot = agg->groups[g].hash & mask;
+    while (agg->slots[slot] != 0) {
+      slot = (slot + 1) & mask;
+    }
+    agg->slots[slot] = g + 1;
+  }
+};
+
+
+
+// the key's group, created if there is room for it. NULL means the rows of
+// this group have to spill
+AggregateGroup* aggregate_find_or_add(AggregateTable* agg, const char* key, uint32_t length, uint32_t hash) {
+  uint32_t mask = agg->num_slots - 1;
+  uint32_t slot = hash & mask;
+  while (agg->slots[slot] != 0) {
+    AggregateGroup* group = &(agg->groups[agg->slots[slot] - 1]);
+    if (group->hash == hash && group->key_length == length && memcmp(agg->keys + group->key_offset, key, length) == 0) {
+      return group;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  if (agg->num_groups >= aggregate_max_groups && agg->depth + 1 < AGGREGATE_MAX_DEPTH) {
+    return NULL;
+  }
+
+  if (agg->num_groups == agg->groups_capacity) {
+    agg->groups_capacity *= 2;
+    agg->groups = realloc(agg->groups, agg->groups_capacity * sizeof(AggregateGroup));
+  }
+  if (agg->keys_used + length > agg->keys_capacity) {
+    agg->keys_capacity = 2 * (agg->keys_capacity + length);
+    agg->keys = realloc(agg->keys, agg->keys_capacity);
+  }
+
+  AggregateGroup* group = &(agg->groups[agg->num_groups]);
+  group->hash = hash;
+  group->key_offset = agg->keys_used;
+  group->key_length = length;
+  group->min_id = UINT32_MAX;
+  group->max_id = 0;
+  group->count = 0;
+  group->sum_id = 0;
+  memcpy(agg->keys + agg->keys_used, key, length);
+  agg->keys_used += length;
+
+  agg->slots[slot] = agg->num_groups + 1;
+  agg->num_groups += 1;
+  if (agg->num_groups * 2 > agg->num_slots) {
+    aggregate_grow_slots(agg);
+    group = &(agg->groups[agg->num_groups - 1]);
+  }
+  return group;
+};
+
+
+
+// a spilled row: uint32 id, uint16 key length, key. the partition comes
+// from the next 4 hash bits, so each pass splits a partition further
+void aggregate_spill(AggregateTable* agg, const char* key, uint32_t length, uint32_t hash, uint32_t id) {
+  uint32_t partition = (hash >> (28 - 4 * agg->depth)) & (AGGREGATE_SPILL_PARTITIONS - 1);
+  if (agg->spills[partition] == NULL) {
+    agg->spills[partition] = tmpfile();
+    if (agg->spills[partition] == NULL) {
+      printf("Unable to create spill file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  uint16_t key_length = length;
+  FILE* spill = agg->spills[partition];
+  if (fwrite(&id, sizeof(id), 1, spill) != 1 || fwrite(&key_length, sizeof(key_length), 1, spill) != 1 ||
+      fwrite(key, 1, length, spill) != length) {
+    printf("Error writing spill file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  stats.rows_spilled += 1;
+};
+
+
+
+void aggregate_add(AggregateTable* agg, const char* key, uint32_t length, uint32_t id) {
+  uint32_t hash = aggregate_hash(key, length);
+  AggregateGroup* group = aggregate_find_or_add(agg, key, length, hash);
+  if (group == NULL) {
+    aggregate_spill(agg, key, length, hash, id);
+    return;
+  }
+
+  group->count += 1;
+  group->sum_id += id;
+  if (id < group->min_id) {
+    group->min_id = id;
+  }
+  if (id > group->max_id) {
+    group->max_id = id;
+  }
+};
+
+
+
+void aggregate_write_group(AggregateTable* agg, AggregateGroup* group, Statement* statement, ResultSink* sink) {
+  SinkField fields[SELECT_MAX_COLUMNS];
+  for (uint32_t i = 0; i < statement->num_columns; i++) {
+    SinkField* field = &(fields[i]);
+    field->text = NULL;
+    field->length = 0;
+    switch (statement->columns[i]) {
+      case (COLUMN_USERNAME):
+      case (COLUMN_EMAIL):
+        field->text = agg->keys + group->key_offset;
+        field->length = group->key_length;
+        break;
+      case (COLUMN_COUNT):
+        field->number = group->count;
+        break;
+      case (COLUMN_MIN_ID):
+        field->number = group->min_id;
+        break;
+      case (COLUMN_MAX_ID):
+        field->number = group->max_id;
+        break;
+      case (COLUMN_SUM_ID):
+        field->number = group->sum_id;
+        break;
+    }
+
+    // only an ungrouped select over an empty table has an empty group
+    if (group->count == 0 && statement->columns[i] != COLUMN_COUNT) {
+      field->text = "NULL";
+      field->length = 4;
+    }
+  }
+  sink_write_fields(sink, fields, statement->num_columns);
+};
+
+
+
+// emit the groups held in memory, then aggregate each spill partition in
+// turn with a fresh table of its own
+void aggregate_finish(AggregateTable* agg, Statement* statement, ResultSink* sink) {
+  for (uint32_t g = 0; g < agg->num_groups; g++) {
+    aggregate_write_group(agg, &(agg->groups[g]), statement, sink);
+  }
+
+  for (uint32_t p = 0; p < AGGREGATE_SPILL_PARTITIONS; p++) {
+    FILE* spill = agg->spills[p];
+    if (spill == NULL) {
+      continue;
+    }
+    rewind(spill);
+
+    AggregateTable partition;
+    aggregate_init(&partition, agg->depth + 1);
+    uint32_t id;
+    uint16_t key_length;
+    char key[COL_EMAIL_SIZE + 1];
+    while (fread(&id, sizeof(id), 1, spill) == 1) {
+      if (fread(&key_length, sizeof(key_length), 1, spill) != 1 || fread(key, 1, key_length, spill) != key_length) {
+        printf("Error reading spill file: %d\n", errno);
+        exit(EXIT_FAILURE);
+      }
+      aggregate_add(&partition, key, key_length, id);
+    }
+    fclose(spill);
+    agg->spills[p] = NULL;
+
+    aggregate_finish(&partition, statement, sink);
+    aggregate_free(&partition);
+  }
+};
+
+
+
+/*
+  SORT
+*/
+
+
+
+// `row` as it is stored in a page (or a run), keyed by sort_order.column
+SortRef sort_ref(void* row) {
+  SortRef ref;
+  ref.row = row;
+  ref.run = 0;
+
+  if (sort_order.column == SORT_USERNAME || sort_order.column == SORT_EMAIL) {
+    // first 8 bytes, big endian and zero padded, so prefixes order like strcmp
+    const uint8_t* text = row + (sort_order.column == SORT_EMAIL ? EMAIL_OFFSET : USERNAME_OFFSET);
+    ref.prefix = 0;
+    bool ended = false;
+    for (uint32_t i = 0; i < 8; i++) {
+      ended = ended || text[i] == '\0';
+      ref.prefix = (ref.prefix << 8) | (ended ? 0 : text[i]);
+    }
+  } else {
+    uint32_t id;
+    memcpy(&id, row + ID_OFFSET, ID_SIZE);
+    ref.prefix = id;
+  }
+  return ref;
+};
+
+
+
+// sort order with ties broken by id, so every order is total
+int sort_compare(const SortRef* a, const SortRef* b) {
+  int result = (a->prefix > b->prefix) - (a->prefix < b->prefix);
+  if (result == 0 && sort_order.column != SORT_ID && sort_order.column != SORT_NONE) {
+    bool email = (sort_order.column == SORT_EMAIL);
+    uint32_t offset = email ? EMAIL_OFFSET : USERNAME_OFFSET;
+    result = strncmp(a->row + offset, b->row + offset, email ? COL_EMAIL_SIZE : COL_USERNAME_SIZE);
+  }
+  if (sort_order.descending) {
+    result = -result;
+  }
+  if (result == 0) {
+    uint32_t id_a, id_b;
+    memcpy(&id_a, a->row + ID_OFFSET, ID_SIZE);
+    memcpy(&id_b, b->row + ID_OFFSET, ID_SIZE);
+    result = (id_a > id_b) - (id_a < id_b);
+  }
+  return result;
+};
+
+
+
+int compare_sort_refs(const void* a, const void* b) {
+  return sort_compare(a, b);
+};
+
+
+
+// binary heap. `worst_on_top` keeps the row that sorts last at the root (the
+// one a top-k evicts), otherwise the root is the next row to emit (merge)
+bool sort_heap_above(SortRef* a, SortRef* b, bool worst_on_top) {
+  int result = sort_compare(a, b);
+  return worst_on_top ? result > 0 : result < 0;
+};
+
+
+
+void sort_heap_sift_down(SortRef* heap, uint32_t size, uint32_t i, bool worst_on_top) {
+  while (true) {
+    uint32_t top = i;
+    uint32_t left = 2 * i + 1;
+    uint32_t right = left + 1;
+    if (left < size && sort_heap_above(&heap[left], &heap[top], worst_on_top)) {
+      top = left;
+    }
+    if (right < size && sort_heap_above(&heap[right], &heap[top], worst_on_top)) {
+      top = right;
+    }
+    if (top == i) {
+      return;
+    }
+    SortRef swap = heap[i];
+    heap[i] = heap[top];
+    heap[top] = swap;
+    i = top;
+  }
+};
+
+
+
+void sort_heap_push(SortRef* heap, uint32_t* size, SortRef ref, bool worst_on_top) {
+  uint32_t i = (*size)++;
+  heap[i] = ref;
+  while (i > 0 && sort_heap_above(&heap[i], &heap[(i - 1) / 2], worst_on_top)) {
+    SortRef swap = heap[i];
+    heap[i] = heap[(i - 1) / 2];
+    heap[(i - 1) / 2] = swap;
+    i = (i - 1) / 2;
+  }
+};
+
+
+
+// small limits: keep the best `limit` rows seen so far in a heap whose root
+// is the worst of them. rows stay in their pages, the heap holds refs
+void sort_top_k(Table* table, uint32_t limit, ResultSink* sink) {
+  SortRef* heap = malloc(limit * sizeof(SortRef));
+  uint32_t size = 0;
+
+  Cursor cursor = table_start(table);
+  while (!(cursor.end_of_table)) {
+    SortRef ref = sort_ref(cursor_value(&cursor));
+    if (size < limit) {
+      sort_heap_push(heap, &size, ref, true);
+    } else if (sort_compare(&ref, &heap[0]) < 0) {
+      heap[0] = ref;
+      sort_heap_sift_down(heap, size, 0, true);
+    }
+    cursor_advance(&cursor);
+  }
+
+  qsort(heap, size, sizeof(SortRef), compare_sort_refs);
+  for (uint32_t i = 0; i < size; i++) {
+    sink_write_row(sink, heap[i].row);
+  }
+  free(heap);
+};
+
+
+
+// sort a full buffer of refs and write their rows out as one run
+FILE* sort_write_run(SortRef* refs, uint32_t count) {
+  qsort(refs, count, sizeof(SortRef), compare_sort_refs);
+
+  FILE* file = tmpfile();
+  if (file == NULL) {
+    printf("Unable to create sort run: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    if (fwrite(refs[i].row, ROW_SIZE, 1, file) != 1) {
+      printf("Error writing sort run: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+  rewind(file);
+  stats.sort_runs += 1;
+  return file;
+};
+
+
+
+// read the run's next row into its buffer. false once it is used up
+bool sort_run_next(SortRun* run) {
+  return fread(run->row, ROW_SIZE, 1, run->file) == 1;
+};
+
+
+
+// everything else: sort refs in memory while they fit the budget, otherwise
+// write sorted runs to temp files and k-way merge them through a heap
+void sort_external(Table* table, uint32_t limit, ResultSink* sink) {
+  uint32_t max_refs = sort_memory / ROW_SIZE;
+  if (max_refs == 0) {
+    max_refs = 1;
+  }
+  SortRef* refs = malloc(max_refs * sizeof(SortRef));
+  uint32_t count = 0;
+  SortRun* runs = NULL;
+  uint32_t num_runs = 0;
+
+  Cursor cursor = table_start(table);
+  while (!(cursor.end_of_table)) {
+    if (count == max_refs) {
+      runs = realloc(runs, (num_runs + 1) * sizeof(SortRun));
+      runs[num_runs++].file = sort_write_run(refs, count);
+      count = 0;
+    }
+    refs[count++] = sort_ref(cursor_value(&cursor));
+    cursor_advance(&cursor);
+  }
+
+  // it all fit: no runs at all
+  if (num_runs == 0) {
+    qsort(refs, count, sizeof(SortRef), compare_sort_refs);
+    for (uint32_t i = 0; i < count && i < limit; i++) {
+      sink_write_row(sink, refs[i].row);
+    }
+    free(refs);
+    return;
+  }
+
+  if (count > 0) {
+    runs = realloc(runs, (num_runs + 1) * sizeof(SortRun));
+    runs[num_runs++].file = sort_write_run(refs, count);
+  }
+  free(refs);
+
+  // merge: the heap holds the current row of every run not yet used up
+  SortRef* heap = malloc(num_runs * sizeof(SortRef));
+  uint32_t size = 0;
+  for (uint32_t r = 0; r < num_runs; r++) {
+    if (sort_run_next(&runs[r])) {
+      SortRef ref = sort_ref(runs[r].row);
+      ref.run = r;
+      sort_heap_push(heap, &size, ref, false);
+    }
+  }
+
+  uint32_t emitted = 0;
+  while (size > 0 && emitted < limit) {
+    SortRun* run = &runs[heap[0].run];
+    sink_write_row_copy(sink, run->row);
+    emitted++;
+
+    if (sort_run_next(run)) {
+      uint32_t r = heap[0].run;
+      heap[0] = sort_ref(run->row);
+      heap[0].run = r;
+    } else {
+      heap[0] = heap[--size];
     }
+    sort_heap_sift_down(heap, size, 0, false);
   }
+
+  for (uint32_t r = 0; r < num_runs; r++) {
+    fclose(runs[r].file);
+  }
+  free(runs);
+  free(heap);
 };
 
 
 
+/*
+  EXECUTE STATEMENT
+*/
+
 
-void* cursor_value(Cursor* cursor) {
-  uint32_t page_num = cursor->page_num;
-  void* page = get_page(cursor->table->pager, page_num);
 
-  return leaf_node_value(page, cursor->cell_num);
+int compare_row_refs(const void* a, const void* b) {
+  uint32_t key_a = ((const RowRef*)a)->key;
+  uint32_t key_b = ((const RowRef*)b)->key;
+  return (key_a > key_b) - (key_a < key_b);
 };
 
 
 
+// false only if the table's bloom filter rules out every key of the batch,
+// which spares the leaf search for a duplicate
+bool table_may_have_any_key(Table* table, RowRef* refs, uint32_t num_refs) {
+  if (table->bloom == NULL) {
+    return true;
+  }
+  for (uint32_t i = 0; i < num_refs; i++) {
+    if (bloom_may_contain(table->bloom, refs[i].key)) {
+      return true;
+    }
+  }
+  stats.bloom_skips += 1;
+  return false;
+};
 
 
 
-/*
-  STATEMENT
-*/
+void table_bloom_add(Table* table, RowRef* refs, uint32_t num_refs) {
+  if (table->bloom == NULL) {
+    return;
+  }
+  for (uint32_t i = 0; i < num_refs; i++) {
+    bloom_add(table->bloom, refs[i].key);
+  }
+};
 
 
 
-Statement* make_statement() {
-  Statement* statement = malloc(sizeof(Statement));
-  return statement;
-}
+// true if any of the batch keys is already in the leaf. both are sorted,
+// so one merge-style walk is enough
+bool leaf_node_has_any_key(void* node, RowRef* refs, uint32_t num_refs) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t i = 0;
+  uint32_t j = 0;
+
+  while (i < num_cells && j < num_refs) {
+    uint32_t key = *leaf_node_key(node, i);
+    if (key == refs[j].key) {
+      return true;
+    } else if (key < refs[j].key) {
+      i++;
+    } else {
+      j++;
+    }
+  }
+  return false;
+};
 
 
 
+// insert sorted keys that all belong in this leaf and all fit in it.
+// merges from the back, so each existing cell is shifted at most once
+void leaf_node_insert_batch(void* node, RowRef* refs, uint32_t num_refs, const NodeLayout* layout) {
+  uint32_t src = *leaf_node_num_cells(node); // existing cells still in place
+  uint32_t pending = num_refs;
 
-/*
-  PREPARE STATEMENT
-*/
+  while (pending > 0) {
+    uint32_t key = refs[pending - 1].key;
 
+    // every existing cell above this key moves right by `pending` in one block
+    uint32_t block_start = src;
+    while (block_start > 0 && *leaf_node_key(node, block_start - 1) > key) {
+      block_start--;
+    }
+    if (block_start < src) {
+      leaf_node_move_cells(node, block_start + pending, node, block_start, src - block_start, layout);
+    }
+    src = block_start;
 
+    pending--;
+    *leaf_node_key(node, src + pending) = key;
+    serialize_row(refs[pending].row, leaf_node_value(node, src + pending, layout));
+  }
 
-PrepareResult prepare_insert(Buffer* buf, Statement* statement) {
-  statement->type = STATEMENT_INSERT;
+  *leaf_node_num_cells(node) += num_refs;
+};
 
-  // tokenize
 
-  char* keyword = strtok(buf->line, " ");
-  if (keyword == NULL) {
-    return PREPARE_SYNTAX_ERROR;
-  }
 
-  char* id_string = strtok(NULL, " ");
-  if (id_string == NULL) {
-    return PREPARE_SYNTAX_ERROR;
+// true if any key of the sorted batch is already stored. lsm and sharded
+// tables, and those with a hash index, look each key up (mostly a filter
+// or index probe); a plain b-tree takes one descent per leaf and walks the
+// keys that belong there against it
+bool table_has_any_key(Table* table, RowRef* refs, uint32_t num_refs) {
+  if (table->shards != NULL || table->lsm != NULL || table->hash_index != NULL) {
+    for (uint32_t i = 0; i < num_refs; i++) {
+      if (table_lookup(table, refs[i].key) != NULL) {
+        return true;
+      }
+    }
+    return false;
   }
 
-  char* username = strtok(NULL, " ");
-  if (username == NULL) {
-    return PREPARE_SYNTAX_ERROR;
+  uint32_t i = 0;
+  while (i < num_refs) {
+    uint32_t key_limit;
+    Cursor cursor = table_find_with_limit(table, refs[i].key, &key_limit);
+    uint32_t count = 1;
+    while (i + count < num_refs && refs[i + count].key <= key_limit) {
+      count++;
+    }
+    if (table_may_have_any_key(table, refs + i, count) && leaf_node_has_any_key(get_page(table->pager, cursor.page_num), refs + i, count)) {
+      return true;
+    }
+    i += count;
   }
+  return false;
+};
 
-  char* email = strtok(NULL, " ");
-  if (email == NULL) {
-    return PREPARE_SYNTAX_ERROR;
-  }
 
-  // validate
 
-  int id = atoi(id_string);
-  if (id <= 0) {
-    return PREPARE_NEGATIVE_ID;
+// insert a batch that is sorted by key and free of duplicates. a sharded
+// table hands each shard its own keys, still in order. the b-tree checks
+// each leaf's keys just before writing them, which only makes a single row
+// all or nothing: execute_insert checks larger batches in full first
+ExecuteResult table_insert(Table* table, RowRef* refs, uint32_t num_refs) {
+  if (table->shards != NULL) {
+    RowRef* part = malloc(num_refs * sizeof(RowRef));
+    ExecuteResult result = EXECUTE_SUCCESS;
+    for (uint32_t s = 0; s < table->num_shards && result == EXECUTE_SUCCESS; s++) {
+      uint32_t num_part = 0;
+      for (uint32_t i = 0; i < num_refs; i++) {
+        if (shard_of(table, refs[i].key) == s) {
+          part[num_part++] = refs[i];
+        }
+      }
+      if (num_part > 0) {
+        result = table_insert(table->shards[s], part, num_part);
+      }
+    }
+    free(part);
+    return result;
   }
 
-  if (strlen(username) > COL_USERNAME_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
-  }
-  if (strlen(email) > COL_EMAIL_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  if (table->lsm != NULL) {
+    return lsm_insert(table, refs, num_refs);
   }
 
-  // write to statement
-  statement->type = STATEMENT_INSERT;
+  // descend once per leaf, then take every following key up to the
+  // leaf's separator (or until the leaf is full)
+  uint32_t max_cells = table->pager->layout->leaf_node_max_cells;
+  uint32_t i = 0;
+  while (i < num_refs) {
+    uint32_t key_limit;
+    Cursor cursor = table_find_with_limit(table, refs[i].key, &key_limit);
+    void* node = get_page(table->pager, cursor.page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+
+    // case: leaf is full. insert one row the usual way (splitting the leaf)
+    // and descend again, since the split moved the separators
+    if (num_cells >= max_cells) {
+      if (cursor.cell_num < num_cells && *leaf_node_key(node, cursor.cell_num) == refs[i].key) {
+        return EXECUTE_DUPLICATE_KEY;
+      }
+      leaf_node_insert(&cursor, refs[i].key, refs[i].row);
+      table_bloom_add(table, refs + i, 1);
+      i++;
+      continue;
+    }
 
-  statement->row_to_insert.id = id;
-  strcpy(statement->row_to_insert.username, username);
-  strcpy(statement->row_to_insert.email, email);
+    uint32_t room = max_cells - num_cells;
+    uint32_t count = 0;
+    while (i + count < num_refs && count < room && refs[i + count].key <= key_limit) {
+      count++;
+    }
 
-  return PREPARE_SUCCESS;
-};
+    if (table_may_have_any_key(table, refs + i, count) && leaf_node_has_any_key(node, refs + i, count)) {
+      return EXECUTE_DUPLICATE_KEY;
+    }
 
-PrepareResult prepare_select(Statement* statement) {
-  statement->type = STATEMENT_SELECT;
-  return PREPARE_SUCCESS;
+    pager_mark_changed(table->pager, cursor.page_num);
+    leaf_node_insert_batch(node, refs + i, count, table->pager->layout);
+    table_bloom_add(table, refs + i, count);
+    table_index_leaf(table, cursor.page_num, cursor.cell_num);
+    i += count;
+  }
+
+  return EXECUTE_SUCCESS;
 };
 
-PrepareResult prepare_statement(Buffer* buf, Statement* statement) {
-  if (strncmp(buf->line, "insert", 6) == 0) {
-    return prepare_insert(buf, statement);
+
+
+ExecuteResult execute_insert(Statement* statement, Table* table) {
+  uint32_t num_rows = statement->num_rows;
+
+  // sort (refs to) the batch by key. inserts usually arrive sorted already.
+  // statement_push_row keeps room for the refs, so the arena cannot run out
+  RowRef* refs = arena_alloc(&(statement->arena), num_rows * sizeof(RowRef));
+  if (refs == NULL) {
+    printf("No room for %d row refs in the statement arena\n", num_rows);
+    exit(EXIT_FAILURE);
+  }
+  bool sorted = true;
+  for (uint32_t i = 0; i < num_rows; i++) {
+    refs[i].key = statement->rows[i].id;
+    refs[i].row = &(statement->rows[i]);
+    if (i > 0 && refs[i].key < refs[i - 1].key) {
+      sorted = false;
+    }
+  }
+  if (!sorted) {
+    qsort(refs, num_rows, sizeof(RowRef), compare_row_refs);
   }
 
-  if (strcmp(buf->line, "select") == 0) {
-    return prepare_select(statement);
+  // duplicates, within the batch or of stored rows, fail the whole
+  // statement before anything is written. a single row is checked by the
+  // descent that inserts it, an lsm batch by lsm_insert
+  for (uint32_t i = 1; i < num_rows; i++) {
+    if (refs[i].key == refs[i - 1].key) {
+      return EXECUTE_DUPLICATE_KEY;
+    }
+  }
+  if (num_rows > 1 && table->lsm == NULL && table_has_any_key(table, refs, num_rows)) {
+    return EXECUTE_DUPLICATE_KEY;
   }
 
-  // otherwise
-  return PREPARE_UNRECOGNIZED;
-}
+  return table_insert(table, refs, num_rows);
+};
 
 
 
+// select where id = N: at most one row, found without a scan
+ExecuteResult execute_select_id(Statement* statement, Table* table, ResultSink* sink) {
+  sink_begin(sink);
+  void* row = table_lookup(table, statement->select_id);
+  if (row != NULL) {
+    sink_write_row(sink, row);
+  }
+  sink_end(sink);
+  return EXECUTE_SUCCESS;
+};
 
 
 
+// hash aggregation over one scan. rows are read in place, only group keys
+// are copied
+ExecuteResult execute_select_aggregate(Statement* statement, Table* table, ResultSink* sink) {
+  AggregateTable agg;
+  aggregate_init(&agg, 0);
 
-/*
-  EXECUTE STATEMENT
-*/
+  uint32_t key_offset = 0;
+  uint32_t key_size = 0;
+  if (statement->grouped) {
+    key_offset = statement->group_by == COLUMN_EMAIL ? EMAIL_OFFSET : USERNAME_OFFSET;
+    key_size = statement->group_by == COLUMN_EMAIL ? COL_EMAIL_SIZE : COL_USERNAME_SIZE;
+  } else {
+    // one group, present even if the table is empty
+    aggregate_find_or_add(&agg, "", 0, aggregate_hash("", 0));
+  }
 
+  Cursor cursor = table_start(table);
+  while (!(cursor.end_of_table)) {
+    void* row = cursor_value(&cursor);
+    uint32_t id;
+    memcpy(&id, row + ID_OFFSET, ID_SIZE);
+    const char* key = row + key_offset;
+    aggregate_add(&agg, key, strnlen(key, key_size), id);
+    cursor_advance(&cursor);
+  }
 
+  char header[SELECT_MAX_COLUMNS * 16];
+  size_t n = 0;
+  for (uint32_t i = 0; i < statement->num_columns; i++) {
+    n += sprintf(header + n, "%s%s", i > 0 ? "," : "", SELECT_COLUMN_NAMES[statement->columns[i]]);
+  }
+  sprintf(header + n, "\n");
 
-ExecuteResult execute_insert(Statement* statement, Table* table) {
-  void* node = get_page(table->pager, table->root_page_num);
-  uint32_t num_cells = (*leaf_node_num_cells(node));
+  sink_begin_with_header(sink, header);
+  aggregate_finish(&agg, statement, sink);
+  sink_end(sink);
+  aggregate_free(&agg);
+  return EXECUTE_SUCCESS;
+};
 
-  Row* row_to_insert = &(statement->row_to_insert);
-  uint32_t key_to_insert = row_to_insert->id;
 
-  // scan tree, update cursor to insertion position
-  Cursor* cursor = table_find(table, key_to_insert);
 
+ExecuteResult execute_select_ordered(Statement* statement, Table* table, ResultSink* sink) {
+  sort_order.column = statement->order_by;
+  sort_order.descending = statement->descending;
 
-  // case: node was already found or an internal node must be traversed (not yet implemented)
-  if (cursor->cell_num < num_cells) {
-    uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-    if (key_at_index == key_to_insert) {
-      return EXECUTE_DUPLICATE_KEY;
-    }
+  sink_begin(sink);
+  if (statement->limit <= sort_memory / ROW_SIZE) {
+    sort_top_k(table, statement->limit, sink);
+  } else {
+    sort_external(table, statement->limit, sink);
   }
-
-  // case 2: node not found. cursor points to insertion point
-  leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-  free(cursor);
-
+  sink_end(sink);
   return EXECUTE_SUCCESS;
 };
 
 
 
-ExecuteResult execute_select(Statement* statement, Table* table) {
-  Cursor* cursor = table_start(table); // jump to start
+ExecuteResult execute_select(Statement* statement, Table* table, ResultSink* sink) {
+  if (statement->select_id != 0) {
+    return execute_select_id(statement, table, sink);
+  }
+  // everything below scans every shard
+  if (table->shards != NULL) {
+    table_page_in_shards(table);
+  }
+  if (statement->num_columns > 0) {
+    return execute_select_aggregate(statement, table, sink);
+  }
+  if (statement->order_by != SORT_NONE) {
+    return execute_select_ordered(statement, table, sink);
+  }
 
-  // print every row in the table
-  Row row;
-  while (!(cursor->end_of_table)) {
-    deserialize_row(cursor_value(cursor), &row);
-    print_row(&row);
+  Cursor cursor = table_start(table); // jump to start
 
-    cursor_advance(cursor);
-  }
+  // stream every row in the table. rows are read straight out of the pages
+  sink_begin(sink);
+  uint32_t emitted = 0;
+  while (!(cursor.end_of_table) && emitted < statement->limit) {
+    sink_write_row(sink, cursor_value(&cursor));
+    emitted++;
 
-  free(cursor);
+    cursor_advance(&cursor);
+  }
+  sink_end(sink);
 
   return EXECUTE_SUCCESS;
 };
 
 
 
-ExecuteResult execute_statement(Statement* statement, Table* table) {
+ExecuteResult execute_statement(Statement* statement, Table* table, ResultSink* sink) {
   switch (statement->type) {
     case (STATEMENT_INSERT):
       return execute_insert(statement, table);
     case (STATEMENT_SELECT):
-      return execute_select(statement, table);
+      return execute_select(statement, table, sink);
   }
 };
 
@@ -1060,13 +5693,15 @@ ExecuteResult execute_statement(Statement* statement, Table* table) {
 
 
 
-void print_constants() {
+void print_constants(Table* table) {
+  const NodeLayout* layout = table->pager->layout;
+  printf("PAGE_SIZE: %d\n", layout->page_size);
   printf("ROW_SIZE: %d\n", ROW_SIZE);
   printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
   printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
   printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", layout->leaf_node_space_for_cells);
+  printf("LEAF_NODE_MAX_CELLS: %d\n", layout->leaf_node_max_cells);
 };
 
 
@@ -1108,26 +5743,444 @@ void print_tree(Pager* pager, uint32_t page_num, uint32_t indent_level) {
       child = *internal_node_right_child(node);
       print_tree(pager, child, indent_level + 1);
       break;
+    case (NODE_FREE):
+      break;
+  }
+};
+
+
+
+// the lsm counterpart of print_tree: memtable, then runs newest first
+void print_runs(Table* table) {
+  Lsm* lsm = table->lsm;
+  printf("- memtable (size %d)\n", lsm->memtable.num_rows);
+  for (uint32_t r = 0; r < lsm->num_runs; r++) {
+    Run* run = &(lsm->runs[r]);
+    printf(
+      "- run level %d (size %d, pages %d, keys %d-%d)\n",
+      run->level, run->num_rows, run->num_pages, run->min_key, run->max_key
+    );
+  }
+};
+
+
+
+
+
+
+
+uint64_t wall_clock_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+};
+
+
+
+void start_timer(StatementTimer* timer) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  timer->wall_ns = wall_clock_ns();
+  timer->user_ns = usage.ru_utime.tv_sec * 1000000000ull + usage.ru_utime.tv_usec * 1000ull;
+  timer->system_ns = usage.ru_stime.tv_sec * 1000000000ull + usage.ru_stime.tv_usec * 1000ull;
+};
+
+
+
+// same format as sqlite's .timer
+void print_timer(StatementTimer* start) {
+  StatementTimer end;
+  start_timer(&end);
+  printf(
+    "Run Time: real %.6f user %.6f sys %.6f\n",
+    (end.wall_ns - start->wall_ns) / 1e9,
+    (end.user_ns - start->user_ns) / 1e9,
+    (end.system_ns - start->system_ns) / 1e9
+  );
+};
+
+
+
+void print_stats() {
+  printf("statements: %llu\n", (unsigned long long)stats.statements);
+  printf("pages_read: %llu\n", (unsigned long long)stats.pages_read);
+  printf("pages_written: %llu\n", (unsigned long long)stats.pages_written);
+  printf("cache_hits: %llu\n", (unsigned long long)stats.cache_hits);
+  printf("cache_misses: %llu\n", (unsigned long long)stats.cache_misses);
+  printf("node_splits: %llu\n", (unsigned long long)stats.node_splits);
+  printf("tree_descents: %llu\n", (unsigned long long)stats.tree_descents);
+  printf("append_fast_paths: %llu\n", (unsigned long long)stats.append_fast_paths);
+  printf("swizzle_hits: %llu\n", (unsigned long long)stats.swizzle_hits);
+  printf("hash_index_hits: %llu\n", (unsigned long long)stats.hash_index_hits);
+  printf("rows_spilled: %llu\n", (unsigned long long)stats.rows_spilled);
+  printf("sort_runs: %llu\n", (unsigned long long)stats.sort_runs);
+  printf("memtable_flushes: %llu\n", (unsigned long long)stats.memtable_flushes);
+  printf("compactions: %llu\n", (unsigned long long)stats.compactions);
+  printf("bloom_skips: %llu\n", (unsigned long long)stats.bloom_skips);
+  printf("pages_warmed: %llu\n", (unsigned long long)stats.pages_warmed);
+  printf("bytes_serialized: %llu\n", (unsigned long long)stats.bytes_serialized);
+  printf("syscalls: %llu\n", (unsigned long long)stats.syscalls);
+};
+
+
+
+void write_stats_json(FILE* out) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  fprintf(
+    out,
+    "{\"ts_ms\":%llu,\"statements\":%llu,\"pages_read\":%llu,\"pages_written\":%llu,"
+    "\"cache_hits\":%llu,\"cache_misses\":%llu,\"node_splits\":%llu,\"tree_descents\":%llu,"
+    "\"append_fast_paths\":%llu,\"swizzle_hits\":%llu,\"hash_index_hits\":%llu,"
+    "\"rows_spilled\":%llu,\"sort_runs\":%llu,\"memtable_flushes\":%llu,\"compactions\":%llu,"
+    "\"bloom_skips\":%llu,\"pages_warmed\":%llu,\"bytes_serialized\":%llu,\"syscalls\":%llu}\n",
+    (unsigned long long)now.tv_sec * 1000ull + now.tv_nsec / 1000000,
+    (unsigned long long)stats.statements, (unsigned long long)stats.pages_read,
+    (unsigned long long)stats.pages_written, (unsigned long long)stats.cache_hits,
+    (unsigned long long)stats.cache_misses, (unsigned long long)stats.node_splits,
+    (unsigned long long)stats.tree_descents, (unsigned long long)stats.append_fast_paths,
+    (unsigned long long)stats.swizzle_hits, (unsigned long long)stats.hash_index_hits,
+    (unsigned long long)stats.rows_spilled, (unsigned long long)stats.sort_runs,
+    (unsigned long long)stats.memtable_flushes, (unsigned long long)stats.compactions,
+    (unsigned long long)stats.bloom_skips, (unsigned long long)stats.pages_warmed,
+    (unsigned long long)stats.bytes_serialized, (unsigned long long)stats.syscalls
+  );
+  fflush(out);
+};
+
+
+
+// called after every statement. dumps a json line once per interval
+void maybe_log_stats() {
+  if (instrumentation.log == NULL) {
+    return;
+  }
+
+  uint64_t now = wall_clock_ns();
+  if (now - instrumentation.last_log_ns >= instrumentation.log_interval_ns) {
+    write_stats_json(instrumentation.log);
+    instrumentation.last_log_ns = now;
+  }
+};
+
+
+
+// .statslog <path> [interval_ms] | .statslog off
+MetaCommandResult set_stats_log(char* cmd) {
+  char path[256];
+  unsigned int interval_ms = 1000;
+
+  if (instrumentation.log != NULL) {
+    fclose(instrumentation.log);
+    instrumentation.log = NULL;
+  }
+  if (strcmp(cmd, ".statslog off") == 0) {
+    return META_SUCCESS;
+  }
+  if (sscanf(cmd, ".statslog %255s %u", path, &interval_ms) < 1) {
+    return META_UNRECOGNIZED;
+  }
+
+  instrumentation.log = fopen(path, "a");
+  if (instrumentation.log == NULL) {
+    printf("Unable to open stats log '%s'\n", path);
+    return META_SUCCESS;
+  }
+  instrumentation.log_interval_ns = interval_ms * 1000000ull;
+  instrumentation.last_log_ns = 0;
+  return META_SUCCESS;
+};
+
+
+
+// depth of a node below the root, following parent pointers. memoized in
+// `depths` (UINT32_MAX = not known yet, UINT32_MAX - 1 = on the chain being
+// followed, so seeing it again means the parents loop)
+uint32_t node_depth(Table* table, uint32_t page_num, uint32_t* depths) {
+  if (depths[page_num] == UINT32_MAX - 1) {
+    printf("Parent pointers loop back to page %d. Corrupt file\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+  if (depths[page_num] != UINT32_MAX) {
+    return depths[page_num];
+  }
+
+  void* node = get_page(table->pager, page_num);
+  uint32_t depth = 0;
+  if (page_num != table->root_page_num && !is_node_root(node)) {
+    uint32_t parent = *node_parent(node);
+    if (parent == HEADER_PAGE_NUM || parent >= table->pager->num_pages) {
+      printf("Parent page %d of page %d out of range. Corrupt file\n", parent, page_num);
+      exit(EXIT_FAILURE);
+    }
+    depths[page_num] = UINT32_MAX - 1;
+    depth = node_depth(table, parent, depths) + 1;
+  }
+  depths[page_num] = depth;
+  return depth;
+};
+
+
+
+// one pass over every page in file order (not a descent), then a walk of
+// the recorded sibling links to compare logical and physical leaf order
+void analyze_tree(Table* table) {
+  Pager* pager = table->pager;
+  uint32_t num_pages = pager->num_pages;
+  uint32_t page_size = pager->page_size;
+  uint32_t max_cells = pager->layout->leaf_node_max_cells;
+
+  uint32_t depths[TABLE_MAX_PAGES];
+  uint32_t next_leaf[TABLE_MAX_PAGES];
+  bool is_leaf[TABLE_MAX_PAGES];
+  bool has_prev[TABLE_MAX_PAGES];
+  uint32_t level_internal[TABLE_MAX_PAGES];
+  uint32_t level_leaf[TABLE_MAX_PAGES];
+  uint32_t fill_histogram[10];
+  uint32_t height = 0;
+  uint32_t num_leaves = 0;
+  uint32_t num_free = 0;
+  uint64_t total_cells = 0;
+  uint64_t wasted_bytes = 0;
+
+  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+    depths[i] = UINT32_MAX;
+    has_prev[i] = false;
+    level_internal[i] = 0;
+    level_leaf[i] = 0;
+  }
+  memset(fill_histogram, 0, sizeof(fill_histogram));
+
+  // the header page is not part of the tree
+  is_leaf[HEADER_PAGE_NUM] = false;
+  for (uint32_t page_num = HEADER_PAGE_NUM + 1; page_num < num_pages; page_num++) {
+    void* node = get_page(pager, page_num);
+    is_leaf[page_num] = false;
+    if (get_node_type(node) == NODE_FREE) {
+      num_free += 1;
+      wasted_bytes += page_size;
+      continue;
+    }
+
+    uint32_t depth = node_depth(table, page_num, depths);
+    if (depth + 1 > height) {
+      height = depth + 1;
+    }
+
+    is_leaf[page_num] = (get_node_type(node) == NODE_LEAF);
+    if (is_leaf[page_num]) {
+      uint32_t num_cells = *leaf_node_num_cells(node);
+      level_leaf[depth] += 1;
+      num_leaves += 1;
+      total_cells += num_cells;
+      wasted_bytes += page_size - LEAF_NODE_HEADER_SIZE - num_cells * LEAF_NODE_CELL_SIZE;
+
+      uint32_t bucket = num_cells * 10 / max_cells;
+      fill_histogram[bucket < 10 ? bucket : 9] += 1;
+
+      next_leaf[page_num] = *leaf_node_next_leaf(node);
+      if (next_leaf[page_num] != 0 && next_leaf[page_num] < num_pages) {
+        has_prev[next_leaf[page_num]] = true;
+      }
+    } else {
+      level_internal[depth] += 1;
+      wasted_bytes += page_size - INTERNAL_NODE_HEADER_SIZE - *internal_node_num_keys(node) * INTERNAL_NODE_CELL_SIZE;
+    }
+  }
+
+  // logical position (sibling chain) vs physical position (page order).
+  // leaves the chain from the first leaf never reaches have no position
+  uint32_t out_of_order = 0;
+  uint32_t backward_links = 0;
+  uint32_t unreached = 0;
+  uint32_t physical_index = 0;
+  uint32_t logical_index[TABLE_MAX_PAGES];
+  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+    logical_index[i] = UINT32_MAX;
+  }
+  for (uint32_t page_num = 0; page_num < num_pages; page_num++) {
+    if (is_leaf[page_num] && !has_prev[page_num]) {
+      uint32_t index = 0;
+      uint32_t current = page_num;
+      while (index < num_leaves) {
+        logical_index[current] = index++;
+        uint32_t next = next_leaf[current];
+        if (next == 0 || next >= num_pages) {
+          break;
+        }
+        if (next < current) {
+          backward_links += 1;
+        }
+        current = next;
+      }
+      break;
+    }
+  }
+  for (uint32_t page_num = 0; page_num < num_pages; page_num++) {
+    if (is_leaf[page_num]) {
+      if (logical_index[page_num] == UINT32_MAX) {
+        unreached += 1;
+      } else if (logical_index[page_num] != physical_index) {
+        out_of_order += 1;
+      }
+      physical_index += 1;
+    }
+  }
+
+  printf("pages: %d (1 header, %d free)\n", num_pages, num_free);
+  printf("height: %d\n", height);
+  for (uint32_t depth = 0; depth < height; depth++) {
+    printf("level %d: %d internal, %d leaf\n", depth, level_internal[depth], level_leaf[depth]);
   }
+  printf("leaves: %d, cells: %llu, avg fill: %.1f%%\n",
+    num_leaves, (unsigned long long)total_cells,
+    num_leaves ? 100.0 * total_cells / ((double)num_leaves * max_cells) : 0.0);
+  printf("leaf fill histogram:\n");
+  for (uint32_t bucket = 0; bucket < 10; bucket++) {
+    printf("  %3d-%3d%%: %d\n", bucket * 10, bucket * 10 + 10, fill_histogram[bucket]);
+  }
+  printf("leaves out of physical order: %d/%d (%.1f%%), backward links: %d\n",
+    out_of_order, num_leaves, num_leaves ? 100.0 * out_of_order / num_leaves : 0.0, backward_links);
+  if (unreached > 0) {
+    printf("leaves not linked from the first leaf: %d\n", unreached);
+  }
+  printf("wasted bytes: %llu total, %llu per page\n",
+    (unsigned long long)wasted_bytes, (unsigned long long)(num_pages > 1 ? wasted_bytes / (num_pages - 1) : 0));
 };
 
 
 
+MetaCommandResult set_output_mode(char* cmd, ResultSink* sink) {
+  const char* mode = cmd + strlen(".mode");
+  while (*mode == ' ') {
+    mode++;
+  }
 
+  if (strcmp(mode, "text") == 0) {
+    sink->mode = OUTPUT_TEXT;
+  } else if (strcmp(mode, "csv") == 0) {
+    sink->mode = OUTPUT_CSV;
+  } else if (strcmp(mode, "binary") == 0) {
+    sink->mode = OUTPUT_BINARY;
+  } else {
+    return META_UNRECOGNIZED;
+  }
+  return META_SUCCESS;
+};
 
 
 
-MetaCommandResult do_meta_command(char* cmd, Table* table) {
+MetaCommandResult do_meta_command(char* cmd, Table* table, ResultSink* sink) {
   if (strcmp(cmd, ".exit") == 0) {
     db_close(table);
     exit(EXIT_SUCCESS);
+  } else if (table->shards != NULL && strncmp(cmd, ".backup ", 8) == 0) {
+    printf("Not available for sharded tables.\n");
+    return META_SUCCESS;
+  } else if (table->shards != NULL && (strcmp(cmd, ".btree") == 0 || strcmp(cmd, ".header") == 0 || strcmp(cmd, ".analyze") == 0 || strncmp(cmd, ".reorganize", 11) == 0 || strcmp(cmd, ".integrity_check") == 0)) {
+    // each shard is a file and a tree of its own
+    for (uint32_t s = 0; s < table->num_shards; s++) {
+      printf("Shard %d:\n", s);
+      do_meta_command(cmd, table->shards[s], sink);
+    }
+    return META_SUCCESS;
   } else if (strcmp(cmd, ".constants") == 0) {
     printf("Constants:\n");
-    print_constants();
+    print_constants(table->shards != NULL ? table->shards[0] : table);
     return META_SUCCESS;
   } else if (strcmp(cmd, ".btree") == 0) {
+    if (table->lsm != NULL) {
+      printf("Runs:\n");
+      print_runs(table);
+      return META_SUCCESS;
+    }
     printf("Tree:\n");
-    print_tree(table->pager, 0, 0);
+    print_tree(table->pager, table->root_page_num, 0);
+    return META_SUCCESS;
+  } else if (strncmp(cmd, ".mode ", 6) == 0) {
+    return set_output_mode(cmd, sink);
+  } else if (strcmp(cmd, ".header") == 0) {
+    table_sync_header(table);
+    void* header = get_page(table->pager, HEADER_PAGE_NUM);
+    printf("Header:\n");
+    printf("version: %d\n", *header_version(header));
+    printf("page size: %d\n", *header_page_size(header));
+    printf("root page: %d\n", *header_root_page(header));
+    printf("freelist head: %d\n", *header_freelist_head(header));
+    printf("page count: %d\n", *header_page_count(header));
+    printf("checkpoint lsn: %llu\n", (unsigned long long)*header_checkpoint_lsn(header));
+    if (*header_num_shards(header) > 1) {
+      printf("shard: %d of %d\n", *header_shard(header), *header_num_shards(header));
+    }
+    printf("hot pages:");
+    for (uint32_t i = 0; i < *header_num_hot_pages(header) && i < HOT_PAGES_MAX; i++) {
+      printf(" %d", header_hot_pages(header)[i]);
+    }
+    printf("\n");
+    return META_SUCCESS;
+  } else if (table->lsm != NULL && (strcmp(cmd, ".analyze") == 0 || strncmp(cmd, ".reorganize", 11) == 0)) {
+    // runs are written in key order and never change: nothing to analyze
+    printf("Not available for lsm tables.\n");
+    return META_SUCCESS;
+  } else if (strcmp(cmd, ".analyze") == 0) {
+    printf("Analyze:\n");
+    analyze_tree(table);
+    return META_SUCCESS;
+  } else if (strncmp(cmd, ".reorganize", 11) == 0) {
+    // .reorganize [max steps]. small batches interleave with other statements
+    int max_steps = 8;
+    sscanf(cmd, ".reorganize %d", &max_steps);
+    int steps = 0;
+    while (steps < max_steps && reorganize_step(table, true)) {
+      steps++;
+    }
+    bool more = reorganize_step(table, false);
+    printf("Reorganized: %d steps, %s\n", steps, more ? "more to do." : "done.");
+    return META_SUCCESS;
+  } else if (strncmp(cmd, ".backup ", 8) == 0) {
+    char path[256];
+    char mode[16] = "";
+    if (sscanf(cmd, ".backup %255s %15s", path, mode) < 1) {
+      return META_UNRECOGNIZED;
+    }
+    if (mode[0] != '\0' && strcmp(mode, "incremental") != 0) {
+      return META_UNRECOGNIZED;
+    }
+    backup_table(table, path, mode[0] != '\0');
+    return META_SUCCESS;
+  } else if (strcmp(cmd, ".integrity_check") == 0) {
+    integrity_check(table);
+    return META_SUCCESS;
+  } else if (strcmp(cmd, ".stats") == 0) {
+    printf("Stats:\n");
+    print_stats();
+    return META_SUCCESS;
+  } else if (strcmp(cmd, ".stats reset") == 0) {
+    memset(&stats, 0, sizeof(Stats));
+    return META_SUCCESS;
+  } else if (strncmp(cmd, ".statslog ", 10) == 0) {
+    return set_stats_log(cmd);
+  } else if (strncmp(cmd, ".agglimit ", 10) == 0) {
+    // groups an aggregate holds in memory before it spills to disk
+    unsigned int max_groups;
+    if (sscanf(cmd, ".agglimit %u", &max_groups) != 1 || max_groups == 0) {
+      return META_UNRECOGNIZED;
+    }
+    aggregate_max_groups = max_groups;
+    return META_SUCCESS;
+  } else if (strncmp(cmd, ".sortmem ", 9) == 0) {
+    // kb of rows an order by holds before it writes sorted runs
+    unsigned int kb;
+    if (sscanf(cmd, ".sortmem %u", &kb) != 1 || kb == 0) {
+      return META_UNRECOGNIZED;
+    }
+    sort_memory = kb * 1024;
+    return META_SUCCESS;
+  } else if (strcmp(cmd, ".timer on") == 0) {
+    instrumentation.timer = true;
+    return META_SUCCESS;
+  } else if (strcmp(cmd, ".timer off") == 0) {
+    instrumentation.timer = false;
     return META_SUCCESS;
   } else {
     return META_UNRECOGNIZED;
@@ -1156,6 +6209,9 @@ bool is_metacommand (char* str) {
 void print_prompt() { printf("db > "); }
 
 
+// bench.c includes this file for in-process access to the engine and
+// brings its own main
+#ifndef DB_NO_MAIN
 int main(int argc, char* argv[]) {
   // args check
   if (argc < 2) {
@@ -1164,19 +6220,77 @@ int main(int argc, char* argv[]) {
   }
 
   char* filename = argv[1];
-  Table* table = db_open(filename);
+
+  // --page-size N: only used when the file is created
+  // --hash-index: keep a hash index for select where id = N
+  // --bloom: keep a bloom filter in front of the tree for absent keys
+  // --engine btree|lsm: only used when the file is created
+  // --direct-io: read and write the file with O_DIRECT, past the os page cache
+  // --warm-up: load the top of the tree and the last session's hot pages
+  // while waiting for input
+  // --shards N: hash partition the table across N files. only used when the
+  // file is created
+  uint32_t page_size = DEFAULT_PAGE_SIZE;
+  uint32_t num_shards = 1;
+  bool hash_index = false;
+  bool bloom = false;
+  bool direct_io = false;
+  bool warm_up = false;
+  Engine engine = ENGINE_BTREE;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+      page_size = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--hash-index") == 0) {
+      hash_index = true;
+    } else if (strcmp(argv[i], "--bloom") == 0) {
+      bloom = true;
+    } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      engine = strcmp(argv[++i], "lsm") == 0 ? ENGINE_LSM : ENGINE_BTREE;
+    } else if (strcmp(argv[i], "--direct-io") == 0) {
+      direct_io = true;
+    } else if (strcmp(argv[i], "--warm-up") == 0) {
+      warm_up = true;
+    } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+      num_shards = strtoul(argv[++i], NULL, 10);
+    }
+  }
+  if (node_layout_for(page_size) == NULL) {
+    printf("Page size must be a power of two from %d to %d\n", MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+    exit(EXIT_FAILURE);
+  }
+  if (num_shards < 1 || num_shards > SHARDS_MAX) {
+    printf("Shards must be from 1 to %d\n", SHARDS_MAX);
+    exit(EXIT_FAILURE);
+  }
+
+  Table* table = db_open(filename, page_size, engine, num_shards, direct_io);
+  if (hash_index) {
+    table_build_hash_index(table);
+  }
+  if (bloom) {
+    table_build_bloom(table);
+  }
+  if (warm_up) {
+    table_warm_up_start(table);
+  }
 
   Buffer* line_buffer = make_buffer();
-  Statement* statement = make_statement();
+  ResultSink* sink = make_sink(STDOUT_FILENO);
+
+  // one statement (and its arena) reused for the whole session
+  Statement statement;
+  init_statement(&statement);
 
   while (true) {
+    // idle until the next line arrives anyway
+    table_warm_up_step(table);
     print_prompt();
     read_input(line_buffer);
 
     // case 1: meta command
 
     if (is_metacommand(line_buffer->line)) {
-      switch (do_meta_command(line_buffer->line, table)) {
+      switch (do_meta_command(line_buffer->line, table, sink)) {
         case (META_SUCCESS):
           continue;
         case (META_UNRECOGNIZED):
@@ -1188,7 +6302,9 @@ int main(int argc, char* argv[]) {
 
     // case 2: prepare and execute sql statement (mutative)
 
-    switch (prepare_statement(line_buffer, statement)) {
+    reset_statement(&statement);
+
+    switch (prepare_statement(line_buffer, &statement)) {
       case (PREPARE_SUCCESS):
         break;
       case (PREPARE_SYNTAX_ERROR):
@@ -1200,6 +6316,12 @@ int main(int argc, char* argv[]) {
       case (PREPARE_NEGATIVE_ID):
         printf("ID must be positive\n");
         continue;
+      case (PREPARE_TOO_MANY_ROWS):
+        printf("Too many rows in one statement\n");
+        continue;
+      case (PREPARE_NOT_GROUPED):
+        printf("Selected text columns must be the group by column\n");
+        continue;
       case (PREPARE_UNRECOGNIZED):
         printf("Unrecognized keyword at start of '%s'\n", line_buffer->line);
         continue;
@@ -1208,7 +6330,10 @@ int main(int argc, char* argv[]) {
 
     // execute statement
 
-    switch (execute_statement(statement, table)) {
+    StatementTimer timer;
+    start_timer(&timer);
+
+    switch (execute_statement(&statement, table, sink)) {
       case (EXECUTE_SUCCESS):
         printf("Executed.\n");
         break;
@@ -1219,5 +6344,12 @@ int main(int argc, char* argv[]) {
         printf("Error: Table full.\n");
         break;
     }
+
+    stats.statements += 1;
+    if (instrumentation.timer) {
+      print_timer(&timer);
+    }
+    maybe_log_stats();
   }
 }
+#endif
@@ -1,17 +1,17 @@
 RSpec.describe 'database' do
   # delete and recompile db executable before starting suite
   before(:all) do
-    `rm -rf a.out; gcc db.c`
+    `rm -rf a.out; cc db.c -lpthread`
   end
 
   # delete test dbfile before each test
   before(:each) do
-    `rm -rf test.db`
+    `rm -rf test.db test.db-wal test.db-shard* backup.db`
   end
 
-  def run_script(commands)
+  def run_script(commands, db_file = "test.db")
     raw_output = nil
-    db_executable = "./a.out test.db"
+    db_executable = "./a.out #{db_file}"
 
     IO.popen(db_executable, "r+") do |pipe|
       commands.each do |command|
@@ -30,6 +30,25 @@ RSpec.describe 'database' do
     raw_output.split("\n")
   end
 
+  # crc32c of a page with its checksum field (bytes 6-9) left out
+  def page_checksum(page)
+    crc = 0xFFFFFFFF
+    (page[0, 6] + page[10..-1]).each_byte do |byte|
+      crc ^= byte
+      8.times { crc = crc & 1 == 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1 }
+    end
+    crc ^ 0xFFFFFFFF
+  end
+
+  def write_pages(filename, pages)
+    File.open(filename, "wb") do |file|
+      pages.each do |page|
+        page[6, 4] = [page_checksum(page)].pack("V")
+        file.write(page)
+      end
+    end
+  end
+
   it 'inserts and retrieves a row' do
     result = run_script([
       "insert 1 user1 person1@example.com",
@@ -103,6 +122,79 @@ RSpec.describe 'database' do
     ])
   end
 
+  it 'inserts multiple rows with one statement' do
+    script = [
+      "insert values (2, user2, person2@example.com), (1, user1, person1@example.com)",
+      "insert values (3, user3)",
+      "select",
+      ".exit"
+    ]
+    result = run_script(script)
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Syntax error in statement 'insert values (3, user3)'",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "Executed.",
+      "db > "
+    ])
+  end
+
+  it 'inserts nothing from a batch with a duplicate in a later leaf' do
+    script = (1..20).map do |i|
+      "insert #{i * 2} user#{i * 2} person#{i * 2}@example.com"
+    end
+    # 1 and 3 belong in the first leaf, 30 is already in the second
+    script << "insert values (3, a, a@example.com), (30, b, b@example.com), (1, c, c@example.com)"
+    script << "select count(*), min(id)"
+    script << ".exit"
+    [[], ["--hash-index"], ["--shards 3"]].each do |options|
+      `rm -rf test.db test.db-shard*`
+      result = run_script(script, (["test.db"] + options).join(" "))
+      expect(result.last(4)).to eq([
+        "db > Error: Duplicate key.",
+        "db > (20, 2)",
+        "Executed.",
+        "db > "
+      ])
+    end
+  end
+
+  it 'prints rows as csv in csv mode' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "insert 2 user,2 person2@example.com",
+      ".mode csv",
+      "select",
+      ".exit"
+    ]
+    result = run_script(script)
+    expect(result).to eq([
+      "db > Executed.",
+      "db > Executed.",
+      "db > db > id,username,email",
+      "1,user1,person1@example.com",
+      "2,\"user,2\",person2@example.com",
+      "Executed.",
+      "db > "
+    ])
+  end
+
+  it 'fills the output buffer to the last byte with 10-digit ids' do
+    # 137 + 326 * 200 bytes of rows leave exactly one longest row's worth
+    # of the 64kb output buffer, so the next row must fit to the byte
+    script = ["insert 1000000000 #{"a" * 20} #{"b" * 100}"]
+    (1..327).each do |i|
+      script << "insert #{1000000000 + i} #{"c" * 32} #{"d" * 151}"
+    end
+    script << "select"
+    script << ".exit"
+    result = run_script(script, "test.db --page-size 65536")
+    rows = result.select { |line| line.include?("(100000") }
+    expect(rows.length).to eq(328)
+    expect(rows.last).to eq("(1000000327, #{"c" * 32}, #{"d" * 151})")
+  end
+
   it 'keeps data after closing connection' do
     result1 = run_script([
       "insert 1 user1 person1@example.com",
@@ -133,16 +225,370 @@ RSpec.describe 'database' do
 
     expect(result).to match_array([
       "db > Constants:",
+      "PAGE_SIZE: 4096",
       "ROW_SIZE: 293",
-      "COMMON_NODE_HEADER_SIZE: 6",
-      "LEAF_NODE_HEADER_SIZE: 14",
+      "COMMON_NODE_HEADER_SIZE: 10",
+      "LEAF_NODE_HEADER_SIZE: 18",
       "LEAF_NODE_CELL_SIZE: 297",
-      "LEAF_NODE_SPACE_FOR_CELLS: 4082",
+      "LEAF_NODE_SPACE_FOR_CELLS: 4078",
       "LEAF_NODE_MAX_CELLS: 13",
       "db > "
     ])
   end
 
+  it 'keeps the page size chosen when the file was created' do
+    script = (1..40).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "test.db --page-size 16384")
+
+    result = run_script([".constants", ".btree", ".exit"])
+    expect(result).to include("PAGE_SIZE: 16384")
+    expect(result).to include("LEAF_NODE_MAX_CELLS: 55")
+    expect(result).to include("- leaf (size 40)")
+  end
+
+  it 'rejects an unsupported page size' do
+    result = run_script([".exit"], "test.db --page-size 5000")
+    expect(result).to eq([
+      "Page size must be a power of two from 4096 to 65536"
+    ])
+  end
+
+  it 'prints statement timings and counters' do
+    script = [
+      ".timer on",
+      "insert 1 user1 person1@example.com",
+      ".timer off",
+      "insert 2 user2 person2@example.com",
+      ".stats",
+      ".exit"
+    ]
+    result = run_script(script)
+    expect(result[1]).to start_with("Run Time: real ")
+    expect(result[3]).to eq("db > Stats:")
+    expect(result).to include(
+      "statements: 2",
+      "node_splits: 0",
+      "tree_descents: 1",
+      "append_fast_paths: 1",
+      "bytes_serialized: 586"
+    )
+  end
+
+  it 'reuses swizzled child frames on repeated descents' do
+    script = (1..30).reverse_each.map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".stats"
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to include(
+      "tree_descents: 30",
+      "swizzle_hits: 13"
+    )
+  end
+
+  it 'selects a single row by id, with or without the hash index' do
+    script = [5, 17, 2, 11, 20, 8, 14, 1, 19, 3, 16, 6, 12, 9, 18].map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select where id = 11"
+    script << "select where id = 4"
+    script << ".exit"
+    result = run_script(script)
+    expect(result.last(4)).to eq([
+      "db > (11, user11, person11@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > ",
+    ])
+
+    # the index is rebuilt from the leaves when the db is opened
+    result = run_script([
+      "insert 4 user4 person4@example.com",
+      "select where id = 4",
+      "select where id=16",
+      "select where id = 21",
+      ".stats",
+      ".exit",
+    ], "test.db --hash-index")
+    expect(result).to include(
+      "db > (4, user4, person4@example.com)",
+      "db > (16, user16, person16@example.com)",
+      "hash_index_hits: 2"
+    )
+  end
+
+  it 'turns away absent ids with a bloom filter' do
+    script = (1..20).map do |i|
+      "insert #{i * 2} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    # rebuilt from the leaves on open, then kept up to date by inserts
+    result = run_script([
+      "select where id = 7",
+      "select where id = 8",
+      "insert 8 dup dup@example.com",
+      "insert 7 user7 person7@example.com",
+      "select where id = 7",
+      ".stats reset",
+      "select where id = 9",
+      "select where id = 11",
+      ".stats",
+      ".exit",
+    ], "test.db --bloom")
+    expect(result[0, 6]).to eq([
+      "db > Executed.",
+      "db > (8, user4, person4@example.com)",
+      "Executed.",
+      "db > Error: Duplicate key.",
+      "db > Executed.",
+      "db > (7, user7, person7@example.com)",
+    ])
+    expect(result).to include("bloom_skips: 2", "tree_descents: 0")
+  end
+
+  it 'spreads a table across shard files and reads it back in key order' do
+    # more rows than one file of 4k pages can hold
+    ids = (1..80).to_a.shuffle(random: Random.new(7))
+    script = ids.each_slice(10).map do |slice|
+      "insert values " + slice.map { |i| "(#{i}, user#{i}, person#{i}@example.com)" }.join(", ")
+    end
+    script << ".exit"
+    run_script(script, "test.db --shards 3")
+    expect(File.exist?("test.db-shard1")).to eq(true)
+    expect(File.exist?("test.db-shard2")).to eq(true)
+
+    # the shard count comes from the file from now on
+    result = run_script([
+      "select",
+      "select where id = 77",
+      "select count(*), min(id), max(id)",
+      "insert 77 dup dup@example.com",
+      ".exit",
+    ])
+    rows = result.join("\n").scan(/\((\d+), user/).flatten.map(&:to_i)
+    expect(rows).to eq((1..80).to_a + [77])
+    expect(result).to include("db > (80, 1, 80)", "db > Error: Duplicate key.")
+
+    result = run_script([".header", ".exit"])
+    expect(result).to include("shard: 0 of 3", "shard: 2 of 3")
+
+    `rm test.db-shard2`
+    result = run_script([".exit"])
+    expect(result).to eq(["Shard file test.db-shard2 is missing. Corrupt db"])
+  end
+
+  it 'warms up the pages the last session used most' do
+    script = (1..40).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+    run_script([
+      "select where id = 40",
+      "select where id = 39",
+      "select where id = 40",
+      ".exit",
+    ])
+
+    result = run_script([".header", ".exit"])
+    expect(result).to include("hot pages: 5 1 4")
+
+    # the first prompt comes after one warm-up step, so the lookup that
+    # follows finds its pages already loaded
+    result = run_script([
+      ".stats reset",
+      "select where id = 40",
+      ".stats",
+      ".exit",
+    ], "test.db --warm-up")
+    expect(result).to include("cache_misses: 0", "pages_warmed: 0")
+    expect(result).to include("db > db > (40, user40, person40@example.com)")
+
+    result = run_script([".stats", ".exit"], "test.db --warm-up")
+    expect(result).to include("pages_warmed: 4")
+  end
+
+  it 'reads and writes the same file with direct i/o' do
+    script = (1..20).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "test.db --direct-io")
+
+    # a filesystem without O_DIRECT says so once and carries on buffered
+    result = run_script([
+      "select where id = 13",
+      ".integrity_check",
+      ".exit",
+    ], "test.db --direct-io") - ["Direct I/O not supported here, using buffered I/O"]
+    expect(result).to eq([
+      "db > (13, user13, person13@example.com)",
+      "Executed.",
+      "db > Integrity check: 4 pages, 0 bad.",
+      "db > ",
+    ])
+
+    result = run_script(["select", ".exit"])
+    expect(result.count { |line| line.start_with?("(") || line.start_with?("db > (") }).to eq(20)
+  end
+
+  it 'aggregates rows, grouped or not' do
+    script = ["select count(*), min(id)"]
+    (1..12).each do |i|
+      script << "insert #{i} user#{i % 3} person#{i}@example.com"
+    end
+    script << "select count(*), min(id), max(id), sum(id)"
+    script << "select username, count(*), sum(id) group by username"
+    script << "select email, count(*)"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[0]).to eq("db > (0, NULL)")
+    expect(result).to include(
+      "db > (12, 1, 12, 78)",
+      "db > (user1, 4, 22)",
+      "(user2, 4, 26)",
+      "(user0, 4, 30)",
+      "db > Selected text columns must be the group by column"
+    )
+  end
+
+  it 'spills groups that do not fit in memory' do
+    script = (1..12).map do |i|
+      "insert #{i} user#{i % 6} person#{i}@example.com"
+    end
+    script << ".agglimit 2"
+    script << "select username, max(id) group by username"
+    script << ".stats"
+    script << ".exit"
+    result = run_script(script)
+    groups = result.map { |line| line.gsub("db > ", "") }.grep(/^\(user/)
+    expect(groups).to match_array([
+      "(user0, 12)", "(user1, 7)", "(user2, 8)",
+      "(user3, 9)", "(user4, 10)", "(user5, 11)",
+    ])
+    expect(result).to include("rows_spilled: 8")
+  end
+
+  it 'orders rows by any column, with a limit or through sorted runs' do
+    script = [
+      "insert 1 carol carol@example.com",
+      "insert 2 alice zed@example.com",
+      "insert 3 bob bob@example.com",
+      "insert 4 alice alice@example.com",
+      "select order by username limit 3",
+      "select order by email desc limit 1",
+      "select limit 1",
+      ".sortmem 1",
+      "select order by username desc",
+      ".stats",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result[4, 3]).to eq([
+      "db > (2, alice, zed@example.com)",
+      "(4, alice, alice@example.com)",
+      "(3, bob, bob@example.com)",
+    ])
+    expect(result[8]).to eq("db > (2, alice, zed@example.com)")
+    expect(result[10]).to eq("db > (1, carol, carol@example.com)")
+    expect(result[12, 4]).to eq([
+      "db > db > (1, carol, carol@example.com)",
+      "(3, bob, bob@example.com)",
+      "(2, alice, zed@example.com)",
+      "(4, alice, alice@example.com)",
+    ])
+    expect(result).to include("sort_runs: 2")
+  end
+
+  it 'keeps an lsm table in runs and replays its log after a crash' do
+    script = (1..60).map do |i|
+      "insert #{61 - i} user#{i} person#{i}@example.com"
+    end
+    script << "insert 30 dup dup@example.com"
+    # no .exit: the process dies with rows still in the memtable
+    result = run_script(script, "test.db --engine lsm")
+    expect(result.last(2)).to eq([
+      "db > Error: Duplicate key.",
+      "db > Error reading input",
+    ])
+
+    result = run_script([
+      "select where id = 7",
+      "select count(*), min(id), max(id)",
+      ".btree",
+      ".stats",
+      ".exit",
+    ])
+    expect(result[0, 7]).to eq([
+      "db > (7, user54, person54@example.com)",
+      "Executed.",
+      "db > (60, 1, 60)",
+      "Executed.",
+      "db > Runs:",
+      "- memtable (size 8)",
+      "- run level 0 (size 52, pages 4, keys 9-60)",
+    ])
+    expect(result).to include("memtable_flushes: 1")
+
+    result = run_script([".btree", ".exit"])
+    expect(result[0, 4]).to eq([
+      "db > Runs:",
+      "- memtable (size 0)",
+      "- run level 0 (size 8, pages 1, keys 1-8)",
+      "- run level 0 (size 52, pages 4, keys 9-60)",
+    ])
+  end
+
+  it 'compacts lsm runs into deeper levels' do
+    keys = (0...300).map { |i| (i * 37) % 300 + 1 }
+    script = keys.map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".btree"
+    script << ".stats"
+    script << ".exit"
+    # 5 memtables worth of rows: one level 0 run too many
+    result = run_script(script, "test.db --engine lsm")
+    expect(result).to include("memtable_flushes: 5")
+    expect(result).to include("compactions: 2")
+    expect(result[300, 3]).to eq([
+      "db > Runs:",
+      "- memtable (size 40)",
+      "- run level 2 (size 260, pages 20, keys 1-300)",
+    ])
+
+    result = run_script(["select", ".exit"])
+    expect(result[0, 300]).to eq((1..300).map do |i|
+      "#{i == 1 ? "db > " : ""}(#{i}, user#{i}, person#{i}@example.com)"
+    end)
+  end
+
+  it 'reports a full lsm table instead of running out of pages' do
+    keys = (0...1200).map { |i| (i * 7919) % 100000 + 1 }
+    script = keys.map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    result = run_script(script, "test.db --engine lsm")
+    inserted = result.count("db > Executed.")
+    expect(inserted < 1200).to eq(true)
+    expect(result.last(2)).to eq([
+      "db > Error: Table full.",
+      "db > ",
+    ])
+    expect(File.exist?("test.db-wal")).to eq(false)
+
+    result = run_script([".integrity_check", "select count(*)", ".exit"])
+    expect(result[0]).to match(/^db > Integrity check: \d+ pages, 0 bad\.$/)
+    expect(result[1]).to eq("db > (#{inserted})")
+  end
+
   it 'allows printing structure of one-node btree' do
     script = [3, 1, 2].map do |i|
       "insert #{i} user#{i} person#{i}@gmail.com"
@@ -182,7 +628,20 @@ RSpec.describe 'database' do
     ])
   end
 
-  it 'allows printing out the structure of a 3-leaf-node btree' do
+  it 'prints an error message if there is a duplicate id in a multi-leaf btree' do
+    script = (1..14).map do |i|
+      "insert #{i} user#{i} person#{i}@gmail.com"
+    end
+    script << "insert 10 user10 person10@gmail.com"
+    script << ".exit"
+    result = run_script(script)
+    expect(result.last(2)).to eq([
+      "db > Error: Duplicate key.",
+      "db > "
+    ])
+  end
+
+  it 'keeps the left leaf full when appending in key order' do
     script = (1..14).map do |i|
       "insert #{i} user#{i} person#{i}@gmail.com"
     end
@@ -194,7 +653,7 @@ RSpec.describe 'database' do
     expect(result[14...(result.length)]).to eq([
       "db > Tree:",
       "- internal (size 1)",
-      "\t- leaf (size 7)",
+      "\t- leaf (size 13)",
       "\t\t- 1",
       "\t\t- 2",
       "\t\t- 3",
@@ -202,18 +661,314 @@ RSpec.describe 'database' do
       "\t\t- 5",
       "\t\t- 6",
       "\t\t- 7",
-      "- key 7",
-      "\t- leaf (size 7)",
       "\t\t- 8",
       "\t\t- 9",
       "\t\t- 10",
       "\t\t- 11",
       "\t\t- 12",
       "\t\t- 13",
+      "- key 13",
+      "\t- leaf (size 1)",
+      "\t\t- 14",
+      "db > Executed.",
+      "db > "
+    ])
+  end
+
+  it 'inserts an unsorted multi-row batch across leaves' do
+    values = (1..16).to_a.reverse.map do |i|
+      "(#{i}, user#{i}, person#{i}@gmail.com)"
+    end
+    script = [
+      "insert values #{values.join(', ')}",
+      "insert values (20, user20, person20@gmail.com), (3, user3, person3@gmail.com)",
+      "select",
+      ".exit"
+    ]
+    result = run_script(script)
+    expect(result[0]).to eq("db > Executed.")
+    expect(result[1]).to eq("db > Error: Duplicate key.")
+    expect(result[2...(result.length)]).to eq(
+      ["db > (1, user1, person1@gmail.com)"] +
+      (2..16).map { |i| "(#{i}, user#{i}, person#{i}@gmail.com)" } +
+      ["Executed.", "db > "]
+    )
+  end
+
+  it 'analyzes tree shape, fill and leaf order' do
+    script = (1..14).map do |i|
+      "insert #{i} user#{i} person#{i}@gmail.com"
+    end
+    script << ".analyze"
+    script << ".exit"
+    result = run_script(script)
+    expect(result[14...(result.length)]).to eq([
+      "db > Analyze:",
+      "pages: 4 (1 header, 0 free)",
+      "height: 2",
+      "level 0: 1 internal, 0 leaf",
+      "level 1: 0 internal, 2 leaf",
+      "leaves: 2, cells: 14, avg fill: 53.8%",
+      "leaf fill histogram:",
+      "    0- 10%: 1",
+      "   10- 20%: 0",
+      "   20- 30%: 0",
+      "   30- 40%: 0",
+      "   40- 50%: 0",
+      "   50- 60%: 0",
+      "   60- 70%: 0",
+      "   70- 80%: 0",
+      "   80- 90%: 0",
+      "   90-100%: 1",
+      "leaves out of physical order: 2/2 (100.0%), backward links: 1",
+      "wasted bytes: 8068 total, 2689 per page",
+      "db > "
+    ])
+  end
+
+  it 'moves leaves into physical key order on reorganize' do
+    script = (1..14).map do |i|
+      "insert #{i} user#{i} person#{i}@gmail.com"
+    end
+    script << ".reorganize"
+    script << ".analyze"
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to include("db > Reorganized: 1 steps, done.")
+    expect(result).to include("leaves out of physical order: 0/2 (0.0%), backward links: 0")
+    expect(result[-6...(result.length)]).to eq([
+      "\t\t- 12",
+      "\t\t- 13",
+      "- key 13",
+      "\t- leaf (size 1)",
       "\t\t- 14",
+      "db > "
+    ])
+  end
+
+  it 'merges an underfull leaf into its sibling on reorganize' do
+    script = (1..14).map do |i|
+      "insert #{i * 2} user#{i} person#{i}@gmail.com"
+    end
+    script << "insert 3 user3 person3@gmail.com"
+    script << ".reorganize 1"
+    script << ".btree"
+    script << ".analyze"
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to include("db > Reorganized: 1 steps, done.")
+    expect(result).to include("pages: 5 (1 header, 1 free)")
+    expect(result).to include("leaves: 2, cells: 15, avg fill: 57.7%")
+    expect(result).to include("- key 12")
+    expect(result).to include("\t- leaf (size 8)")
+    expect(result).to include("(28, user14, person14@gmail.com)")
+  end
+
+  it 'backs up a live database and then only the changed pages' do
+    script = (1..20).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".backup backup.db"
+    script << "insert 21 user21 person21@example.com"
+    script << ".backup backup.db incremental"
+    script << ".backup other.db incremental"
+    script << ".exit"
+    result = run_script(script)
+    `rm -f other.db`
+    expect(result[20...(result.length)]).to eq([
+      "db > Backed up 4 of 4 pages (full).",
+      "db > Executed.",
+      "db > Backed up 1 of 4 pages (incremental).",
+      "db > No earlier backup at 'other.db', taking a full backup.",
+      "Backed up 4 of 4 pages (full).",
+      "db > "
+    ])
+
+    result = run_script(["select", ".exit"], "backup.db")
+    expect(result.length).to eq(23)
+    expect(result[-2]).to eq("Executed.")
+    expect(result[-3]).to eq("(21, user21, person21@example.com)")
+  end
+
+  it 'verifies page checksums on disk' do
+    script = (1..20).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    result = run_script([".integrity_check", ".exit"])
+    expect(result).to eq([
+      "db > Integrity check: 4 pages, 0 bad.",
+      "db > "
+    ])
+
+    # a header counting more pages than the pager can hold is refused
+    # before any check
+    pages = File.binread("test.db").scan(/.{4096}/m)
+    pages[0][22, 4] = [101].pack("V")
+    pages += ["\0" * 4096] * 97
+    write_pages("test.db", pages)
+    result = run_script([".integrity_check", ".exit"])
+    expect(result).to eq([
+      "Db file has 101 pages, more than 100. Corrupt file"
+    ])
+  end
+
+  it 'refuses to load a corrupted page' do
+    script = (1..5).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    File.open("test.db", "r+b") do |file|
+      file.seek(100)
+      byte = file.read(1).ord
+      file.seek(100)
+      file.write((byte ^ 0xFF).chr)
+    end
+
+    result = run_script(["select", ".exit"])
+    expect(result).to eq([
+      "Page 0 failed checksum. Corrupt file"
+    ])
+  end
+
+  it 'ignores a torn page past the page count in the header' do
+    script = (1..14).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    # a crash mid-checkpoint: page 4 written, header still says 4 pages
+    File.open("test.db", "ab") do |file|
+      file.write(Random.new(1).bytes(4096))
+    end
+
+    # the right leaf fills up and splits into page 4
+    script = (15..27).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    result = run_script(script)
+    expect(result.last(2)).to eq([
       "db > Executed.",
       "db > "
     ])
+
+    result = run_script([".integrity_check", "select count(*)", ".exit"])
+    expect(result).to eq([
+      "db > Integrity check: 5 pages, 0 bad.",
+      "db > (27)",
+      "Executed.",
+      "db > "
+    ])
+  end
+
+  it 'upgrades version 1 and 2 files with interleaved cells' do
+    [1, 2].each do |version|
+      `rm -rf test.db`
+      # page 1: root internal node over leaves 2 (keys 1-3) and 3 (keys 4-5).
+      # cells interleave key and value (leaf) or child and key (internal)
+      header = "SQLC" + [version].pack("v") + "\0" * 4 + [4096].pack("V")
+      header += [1, 0, 4, 0, 0].pack("VVVVV") if version == 2
+      root = [0, 1, 0].pack("CCV") + "\0" * 4 + [1, 3, 2, 3].pack("VVVV")
+      leaves = [[2, [1, 2, 3], 3], [3, [4, 5], 0]].map do |page_num, keys, next_leaf|
+        leaf = [1, 0, 1].pack("CCV") + "\0" * 4 + [keys.length, next_leaf].pack("VV")
+        keys.each do |i|
+          leaf += [i].pack("V") + [i].pack("V") + ["user#{i}"].pack("a33") + ["person#{i}@example.com"].pack("a256")
+        end
+        leaf
+      end
+      write_pages("test.db", [header, root, *leaves].map { |page| page.ljust(4096, "\0") })
+
+      result = run_script(["select", ".btree", ".integrity_check", ".exit"])
+      expect(result).to eq([
+        "db > (1, user1, person1@example.com)",
+        "(2, user2, person2@example.com)",
+        "(3, user3, person3@example.com)",
+        "(4, user4, person4@example.com)",
+        "(5, user5, person5@example.com)",
+        "Executed.",
+        "db > Tree:",
+        "- internal (size 1)",
+        "\t- leaf (size 3)",
+        "\t\t- 1",
+        "\t\t- 2",
+        "\t\t- 3",
+        "- key 3",
+        "\t- leaf (size 2)",
+        "\t\t- 4",
+        "\t\t- 5",
+        "db > Integrity check: 4 pages, 0 bad.",
+        "db > "
+      ])
+
+      # written back in the current layout
+      result = run_script([".header", "select where id = 4", ".exit"])
+      expect(result).to include("version: 5")
+      expect(result).to include("db > (4, user4, person4@example.com)")
+    end
+  end
+
+  it 'keeps root, freelist and page count in the header across restarts' do
+    script = (1..14).map do |i|
+      "insert #{i * 2} user#{i} person#{i}@gmail.com"
+    end
+    script << "insert 3 user3 person3@gmail.com"
+    script << ".reorganize"
+    script << ".exit"
+    run_script(script)
+
+    result = run_script([".header", ".exit"])
+    expect(result).to eq([
+      "db > Header:",
+      "version: 5",
+      "page size: 4096",
+      "root page: 1",
+      "freelist head: 2",
+      "page count: 5",
+      "checkpoint lsn: 1",
+      "hot pages: 1 3 4",
+      "db > "
+    ])
+
+    # the next split takes the freed page instead of growing the file
+    script = (30..40).map do |i|
+      "insert #{i} user#{i} person#{i}@gmail.com"
+    end
+    script << ".header"
+    script << ".exit"
+    result = run_script(script)
+    expect(result).to include("freelist head: 0")
+    expect(result).to include("page count: 5")
+    expect(result).to include("checkpoint lsn: 2")
+  end
+
+  it 'checks the whole file without loading it' do
+    script = (1..20).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    File.open("test.db", "r+b") do |file|
+      file.seek(2 * 4096 + 100)
+      byte = file.read(1).ord
+      file.seek(2 * 4096 + 100)
+      file.write((byte ^ 0xFF).chr)
+    end
+
+    result = run_script([".integrity_check", ".exit"])
+    expect(result).to eq([
+      "db > page 2: checksum mismatch",
+      "Integrity check: 4 pages, 1 bad.",
+      "db > "
+    ])
   end
 
   it 'allows printing out the structure of a 4-leaf-node btree' do